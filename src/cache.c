@@ -0,0 +1,214 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include <stdlib.h>
+#include "pagina.h"
+
+/* Decoded-stream cache: a hash table from object ids to decoded data, with
+the entries also kept in a list from most to least recently used. When the
+total size goes over the budget, entries are evicted from the end of the
+list. */
+
+#define DEFAULT_CACHE_BUDGET (64UL<<20)
+
+static size_t
+bucket(pag_stream_cache *cache, unsigned int id)
+{
+	return (id * 2654435761U) & (cache->nbuckets-1);
+}
+
+pag_stream_cache *
+pag_make_stream_cache(void)
+{
+	pag_stream_cache *cache = calloc(1, sizeof(pag_stream_cache));
+	cache->budget = DEFAULT_CACHE_BUDGET;
+	cache->nbuckets = 64;
+	cache->buckets = calloc(cache->nbuckets, sizeof(cache->buckets[0]));
+	return cache;
+}
+
+void
+pag_free_stream_cache(pag_stream_cache *cache)
+{
+	if (cache == NULL)
+		return;
+	for (struct _cache_entry *e = cache->first, *next; e != NULL; e = next) {
+		next = e->next;
+		free(e->data);
+		free(e);
+	}
+	free(cache->buckets);
+	free(cache->scratch);
+	free(cache);
+}
+
+static void
+unlink_entry(pag_stream_cache *cache, struct _cache_entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		cache->first = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		cache->last = e->prev;
+}
+
+static void
+push_front(pag_stream_cache *cache, struct _cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache->first;
+	if (cache->first != NULL)
+		cache->first->prev = e;
+	cache->first = e;
+	if (cache->last == NULL)
+		cache->last = e;
+}
+
+static struct _cache_entry **
+find(pag_stream_cache *cache, unsigned int id)
+{
+	struct _cache_entry **e = &cache->buckets[bucket(cache, id)];
+	while (*e != NULL && (*e)->id != id)
+		e = &(*e)->chain;
+	return e;
+}
+
+static void
+remove_entry(pag_stream_cache *cache, struct _cache_entry **slot)
+{
+	struct _cache_entry *e = *slot;
+	*slot = e->chain;
+	unlink_entry(cache, e);
+	cache->used -= e->len;
+	cache->len--;
+	free(e->data);
+	free(e);
+}
+
+static void
+evict(pag_stream_cache *cache)
+{
+	while (cache->used > cache->budget && cache->last != NULL)
+		remove_entry(cache, find(cache, cache->last->id));
+}
+
+static void
+grow(pag_stream_cache *cache)
+{
+	struct _cache_entry **old = cache->buckets;
+	size_t n = cache->nbuckets;
+	cache->nbuckets *= 2;
+	cache->buckets = calloc(cache->nbuckets, sizeof(cache->buckets[0]));
+	for (size_t i=0; i<n; i++) {
+		struct _cache_entry *e = old[i];
+		while (e != NULL) {
+			struct _cache_entry *next = e->chain;
+			size_t b = bucket(cache, e->id);
+			e->chain = cache->buckets[b];
+			cache->buckets[b] = e;
+			e = next;
+		}
+	}
+	free(old);
+}
+
+char *
+pag_cache_get(pag_stream_cache *cache, unsigned int id, size_t *len)
+{
+	if (cache == NULL)
+		return NULL;
+
+	struct _cache_entry *e = *find(cache, id);
+	if (e == NULL) {
+		cache->misses++;
+		return NULL;
+	}
+
+	cache->hits++;
+	unlink_entry(cache, e);
+	push_front(cache, e);
+	*len = e->len;
+	return e->data;
+}
+
+/* Store decoded data, taking ownership of it, and return it. Without a
+cache, the data is freed and NULL returned. */
+char *
+pag_cache_put(pag_stream_cache *cache, unsigned int id, char *data,
+		size_t len)
+{
+	if (cache == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	free(cache->scratch);
+	cache->scratch = NULL;
+	if (len > cache->budget) {
+		cache->scratch = data;
+		return data;
+	}
+
+	pag_cache_drop(cache, id);
+	struct _cache_entry *e = malloc(sizeof(struct _cache_entry));
+	e->id = id;
+	e->data = data;
+	e->len = len;
+	struct _cache_entry **slot = find(cache, id);
+	e->chain = *slot;
+	*slot = e;
+	push_front(cache, e);
+	cache->used += len;
+	cache->len++;
+
+	evict(cache);
+	if (cache->len > cache->nbuckets)
+		grow(cache);
+	return data;
+}
+
+void
+pag_cache_drop(pag_stream_cache *cache, unsigned int id)
+{
+	if (cache == NULL)
+		return;
+	struct _cache_entry **slot = find(cache, id);
+	if (*slot != NULL)
+		remove_entry(cache, slot);
+}
+
+void
+pag_set_stream_cache_budget(pag_document *doc, size_t budget)
+{
+	doc->cache->budget = budget;
+	evict(doc->cache);
+}
+
+void
+pag_stream_cache_stats(pag_document *doc, unsigned long *hits,
+		unsigned long *misses)
+{
+	*hits = doc->cache->hits;
+	*misses = doc->cache->misses;
+}
@@ -24,6 +24,7 @@ DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
 
 pag_ref *
 pag_get_root(pag_document *doc)
@@ -50,13 +51,25 @@ pag_get_info(pag_document *doc)
 	return &(obj->val.ref);
 }
 
+/* Strings and streams of encrypted documents are encrypted with keys
+derived from the id and generation of their object, which must then be
+kept. */
+int
+pag_is_encrypted(pag_document *doc)
+{
+	pag_dict *tdict = doc->trailer_dicts->val->val.dict;
+	return pag_dict_get(tdict, pag_make_name("Encrypt")) != NULL;
+}
+
 pag_object *
 pag_get_indirect_obj(pag_document *doc, pag_ref ref)
 {
 	if (doc==NULL)
 		return NULL;
 	/* ignore generation, just look for id */
-	return doc->objs[ref.id-1].obj;
+	if (ref.id < 1 || ref.id > (unsigned)doc->len)
+		return NULL;
+	return pag_load_object(doc, ref.id);
 }
 
 void
@@ -66,6 +79,115 @@ pag_set_object(pag_document *doc, pag_ref ref)
 		return;
 	
 	doc->objs[ref.id-1].obj = ref.obj;
+	pag_set_owner(ref.obj, doc, ref.id);
+	pag_mark_dirty(doc, ref.id);
+}
+
+int
+pag_insert_objects(pag_object *objs[], pag_document *doc)
+{
+	if (doc == NULL || objs == NULL)
+		return -1;
+	int n = 0;
+	while (objs[n] != NULL)
+		n++;
+
+	int first = doc->len+1;
+	doc->objs = realloc(doc->objs, (doc->len+n) * sizeof(pag_ref));
+	size_t size = (doc->len+n+1) * sizeof(pag_xref_entry);
+	if (pag_in_index(doc, doc->table.table)) {
+		/* copy the table out of the mapped index */
+		pag_xref_entry *table = malloc(size);
+		memcpy(table, doc->table.table,
+			doc->table.len * sizeof(pag_xref_entry));
+		doc->table.table = table;
+	} else {
+		doc->table.table = realloc(doc->table.table, size);
+	}
+	memset(doc->table.table + doc->len+1, 0, n * sizeof(pag_xref_entry));
+	doc->table.len = doc->len+n+1;
+	if (doc->dirty != NULL) {
+		doc->dirty = realloc(doc->dirty, doc->len+n+1);
+		memset(doc->dirty + doc->len+1, 1, n);
+	}
+	doc->len += n;
+	for (int i=0; i<n; i++) {
+		unsigned int id = first+i;
+		pag_object *obj = objs[i];
+		if (obj->type == PAG_STREAM) {
+			obj->val.stream->id = id;
+			obj->val.stream->cache = doc->cache;
+		}
+		pag_set_owner(obj, doc, id);
+		doc->objs[id-1] = pag_make_ref(id, 0, obj);
+		pag_mark_dirty(doc, id);
+	}
+	return first;
+}
+
+void
+pag_free_document(pag_document *doc)
+{
+	if (doc == NULL)
+		return;
+	for (int i=0; i < doc->len; i++)
+		pag_free_object(doc->objs[i].obj);
+	for (pag_array *t = doc->trailer_dicts, *next; t != NULL; t = next) {
+		next = t->next;
+		pag_free_object(t->val);
+		free(t);
+	}
+	pag_invalidate_pagetree(doc);
+	pag_invalidate_refindex(doc);
+	pag_free_stream_cache(doc->cache);
+	free(doc->objs);
+	if (!pag_in_index(doc, doc->table.table))
+		free(doc->table.table);
+	pag_unmap_index(doc);
+	free(doc->dirty);
+	free(doc);
+}
+
+void
+pag_mark_dirty(pag_document *doc, unsigned int id)
+{
+	if (doc->dirty != NULL && id >= 1 && id <= (unsigned)doc->len)
+		doc->dirty[id] = 1;
+	if (doc->refindex != NULL && id <= (unsigned)doc->len)
+		pag_refindex_touch(doc->refindex, id);
+}
+
+/* Record that the dictionaries in obj belong to indirect object id, so that
+changing them marks it as modified. References are not followed. */
+void
+pag_set_owner(pag_object *obj, pag_document *doc, unsigned int id)
+{
+	if (obj == NULL)
+		return;
+	switch (obj->type) {
+	case PAG_ARRAY:
+		for (pag_array *a = obj->val.array; a != NULL; a = a->next) {
+			a->doc = doc;
+			a->id = id;
+			pag_set_owner(a->val, doc, id);
+		}
+		break;
+	case PAG_STREAM:
+		pag_set_owner(pag_dict2obj(obj->val.stream->dict), doc, id);
+		break;
+	case PAG_DICT: {
+		pag_dict *dict = obj->val.dict;
+		if (dict->doc == doc && dict->id == id)
+			break;
+		dict->doc = doc;
+		dict->id = id;
+		for (int i=0; i < (1<<dict->exp); i++)
+			pag_set_owner(dict->ht[i].obj, doc, id);
+		break;
+	}
+	default:
+		break;
+	}
 }
 
 pag_object *
@@ -97,30 +219,33 @@ page labels (with the corresponding page indices on the left):
 
 In the following, I write a small parser for this format. */
 
-static char *plspec;
-static size_t curindex, plspeclen;
+struct _pllexer {
+	char *spec;
+	size_t cur;
+	size_t len;
+};
 
 static void
-init_pl_lexer(char *spec)
+init_pl_lexer(struct _pllexer *lx, char *spec)
 {
-	plspec = spec;
-	curindex = 0;
-	plspeclen = strlen(plspec);
+	lx->spec = spec;
+	lx->cur = 0;
+	lx->len = strlen(spec);
 }
 
 static char
-read_ch(void)
+read_ch(struct _pllexer *lx)
 {
-	char ch = plspec[curindex];
-	if (curindex <= plspeclen)
-		curindex++;
+	char ch = lx->spec[lx->cur];
+	if (lx->cur <= lx->len)
+		lx->cur++;
 	return ch;
 }
 
 static char
-peek_ch(void)
+peek_ch(struct _pllexer *lx)
 {
-	return plspec[curindex];
+	return lx->spec[lx->cur];
 }
 
 enum pltokentype {
@@ -142,30 +267,30 @@ typedef struct {
 } pltoken;
 
 static void
-skip_underscores(void)
+skip_underscores(struct _pllexer *lx)
 {
 	char ch;
-	while ((ch = read_ch()) == '_') {}
-	curindex--;
+	while ((ch = read_ch(lx)) == '_') {}
+	lx->cur--;
 }
 
-static pltoken read_prefix(void);
-static pltoken read_number(void);
+static pltoken read_prefix(struct _pllexer *lx);
+static pltoken read_number(struct _pllexer *lx);
 
 static pltoken
-read_token(void)
+read_token(struct _pllexer *lx)
 {
 	pltoken t;
 
 	char ch;
-	switch (ch=peek_ch()) {
+	switch (ch=peek_ch(lx)) {
 	case 'A': case 'a': case 'D': case 'R': case 'r':
-		read_ch();
+		read_ch(lx);
 		t.type = PL_NUMTYPE;
 		t.val.numtype = ch;
 		return t;
 	case '/':
-		return read_prefix();
+		return read_prefix(lx);
 	case '\0':
 		t.type = PL_EOS;
 		return t;
@@ -174,7 +299,7 @@ read_token(void)
 		return t;
 	default:
 		if (isdigit(ch))
-			return read_number();
+			return read_number(lx);
 		t.type = PL_ERROR;
 		return t;
 	}
@@ -183,15 +308,15 @@ read_token(void)
 #define PLBUFSIZE 30
 
 static pltoken
-read_prefix(void)
+read_prefix(struct _pllexer *lx)
 {
 	pltoken t;
 
 	char *buf = calloc(PLBUFSIZE+1, 1);
 	size_t i = 0;
 
-	char ch = read_ch(); /* guaranteed '/' */
-	while ((ch=read_ch()) != '/') {
+	char ch = read_ch(lx); /* guaranteed '/' */
+	while ((ch=read_ch(lx)) != '/') {
 		buf[i++] = ch;
 		if (i >= PLBUFSIZE) {
 			t.type = PL_ERROR;
@@ -208,16 +333,16 @@ read_prefix(void)
 	return t;
 }
 
-pltoken
-read_number(void)
+static pltoken
+read_number(struct _pllexer *lx)
 {
 	int val = 0;
 	char ch;
-	while (isdigit(ch=read_ch())) {
+	while (isdigit(ch=read_ch(lx))) {
 		val *= 10;
 		val += (ch-'0');
 	}
-	curindex--;
+	lx->cur--;
 
 	pltoken t = {.type=PL_NUMBER, .val.intv = val};
 	return t;
@@ -232,16 +357,16 @@ typedef struct {
 	char numtype;
 } plrange;
 
-plrange
-read_plrange(int first)
+static plrange
+read_plrange(struct _pllexer *lx, int first)
 {
 	pltoken t1, t2, t3, t4;
 	plrange r = {0};
 	r.numtype = 'D';
 
-	skip_underscores();
+	skip_underscores(lx);
 
-	switch ((t1=read_token()).type) {
+	switch ((t1=read_token(lx)).type) {
 	case PL_PREFIX:
 		r.prefixonly = 1;
 		r.prefix = t1.val.str;
@@ -267,7 +392,7 @@ read_plrange(int first)
 		return r;
 	}
 
-	switch ((t2=read_token()).type) {
+	switch ((t2=read_token(lx)).type) {
 	case PL_NUMTYPE:
 		r.numtype = t2.val.numtype;
 		break;
@@ -279,7 +404,7 @@ read_plrange(int first)
 	}
 
 read_t3:
-	switch ((t3=read_token()).type) {
+	switch ((t3=read_token(lx)).type) {
 	case PL_PREFIX:
 		r.prefix = t3.val.str;
 		break;
@@ -293,7 +418,7 @@ read_t3:
 		return r;
 	}
 
-	switch ((t4=read_token()).type) {
+	switch ((t4=read_token(lx)).type) {
 	case PL_NUMBER:
 		r.start = t4.val.intv;
 		break;
@@ -307,7 +432,7 @@ read_t3:
 
 end:
 	/* require either nothing next or underscore */
-	char ch = peek_ch();
+	char ch = peek_ch(lx);
 	if (!(ch=='_' || ch=='\0'))
 		r.error = 1;
 	
@@ -315,7 +440,7 @@ end:
 }
 
 /* return zero on success */
-int
+static int
 add_range_to_array(pag_array **pl, plrange r)
 {
 	*pl = pag_array_append(*pl, pag_int2obj(pag_make_int(r.index)));
@@ -348,16 +473,17 @@ pag_make_pagelabels(char *spec)
 {
 	pag_dict *pagelabels = pag_make_empty_dict();
 	pag_array *pl = pag_make_empty_array();
-	init_pl_lexer(spec);
+	struct _pllexer lx;
+	init_pl_lexer(&lx, spec);
 
-	plrange r = read_plrange(1);
+	plrange r = read_plrange(&lx, 1);
 	if (r.error)
 		return NULL;
 	if (add_range_to_array(&pl, r) != 0)
 		return NULL;
 
-	while (peek_ch()!='\0') {
-		r = read_plrange(0);
+	while (peek_ch(&lx)!='\0') {
+		r = read_plrange(&lx, 0);
 		if (r.error)
 			return NULL;
 		if (add_range_to_array(&pl, r) != 0)
@@ -366,4 +492,353 @@ pag_make_pagelabels(char *spec)
 
 	pag_dict_set(pagelabels, pag_make_name("Nums"), pag_array2obj(pl));
 	return pag_dict2obj(pagelabels);
-}
\ No newline at end of file
+}
+
+/* A compiled page label table holds the ranges of a /PageLabels number
+tree sorted by first page, so that the label of a page is found by binary
+search. For the reverse, ranges are hashed by prefix: a label is cut at
+each position into a prefix and a number, and only the ranges with that
+prefix are tried. */
+
+static pag_object *
+resolve(pag_document *doc, pag_object *obj)
+{
+	pag_ref *ref = pag_obj2ref(obj);
+	if (ref != NULL)
+		return doc != NULL ? pag_get_indirect_obj(doc, *ref) : NULL;
+	return obj;
+}
+
+static unsigned long
+hash_prefix(const char *s, size_t len)
+{
+	unsigned long h = 2166136261UL; /* FNV-1a */
+	for (size_t i=0; i<len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619UL;
+	return h;
+}
+
+static int
+cmp_ranges(const void *a, const void *b)
+{
+	const struct _label_range *x = a, *y = b;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void
+add_label_range(pag_pagelabels *pl, long index, pag_dict *dict,
+		pag_document *doc)
+{
+	if (pl->len == pl->cap) {
+		pl->cap = pl->cap ? 2*pl->cap : 16;
+		pl->ranges = realloc(pl->ranges,
+			pl->cap * sizeof(struct _label_range));
+	}
+	struct _label_range *r = &pl->ranges[pl->len++];
+	r->index = index;
+	r->style = 0;
+	r->prefix = NULL;
+	r->prefixlen = 0;
+	r->start = 1;
+
+	pag_name *style = pag_obj2name(resolve(doc,
+		pag_dict_get(dict, pag_make_name("S"))));
+	if (style != NULL && strlen(style->str) == 1
+	    && strchr("DRrAa", style->str[0]) != NULL)
+		r->style = style->str[0];
+	pag_string *prefix = pag_obj2string(resolve(doc,
+		pag_dict_get(dict, pag_make_name("P"))));
+	if (prefix != NULL) {
+		r->prefix = malloc(prefix->len+1);
+		memcpy(r->prefix, prefix->str, prefix->len);
+		r->prefix[prefix->len] = 0;
+		r->prefixlen = prefix->len;
+	}
+	pag_object *start = resolve(doc, pag_dict_get(dict,
+		pag_make_name("St")));
+	if (start != NULL && start->type == PAG_INT && start->val.intv.val > 0)
+		r->start = start->val.intv.val;
+}
+
+struct _plcompile {
+	pag_pagelabels *pl;
+	pag_document *doc;
+};
+
+static int
+compile_entry(pag_object *key, pag_object *val, void *arg)
+{
+	struct _plcompile *c = arg;
+	pag_dict *range = pag_obj2dict(val);
+	if (key != NULL && key->type == PAG_INT && key->val.intv.val >= 0
+	    && range != NULL)
+		add_label_range(c->pl, key->val.intv.val, range, c->doc);
+	return 0;
+}
+
+pag_pagelabels *
+pag_compile_pagelabels(pag_object *labels, pag_document *doc, int nbpages)
+{
+	if (pag_obj2dict(resolve(doc, labels)) == NULL)
+		return NULL;
+
+	pag_pagelabels *pl = calloc(1, sizeof(pag_pagelabels));
+	pl->nbpages = nbpages;
+	struct _plcompile c = {pl, doc};
+	pag_tree_foreach(doc, labels, compile_entry, &c);
+	qsort(pl->ranges, pl->len, sizeof(struct _label_range), cmp_ranges);
+
+	pl->nbuckets = 1;
+	while (pl->nbuckets < 2*pl->len)
+		pl->nbuckets *= 2;
+	pl->buckets = malloc(pl->nbuckets * sizeof(int));
+	for (size_t i=0; i<pl->nbuckets; i++)
+		pl->buckets[i] = -1;
+	/* chains keep the ranges in page order */
+	for (size_t i=pl->len; i-- > 0; ) {
+		struct _label_range *r = &pl->ranges[i];
+		size_t h = hash_prefix(r->prefix, r->prefixlen)
+			& (pl->nbuckets-1);
+		r->next = pl->buckets[h];
+		pl->buckets[h] = i;
+	}
+	return pl;
+}
+
+pag_pagelabels *
+pag_get_pagelabels(pag_document *doc)
+{
+	pag_ref *ref = pag_get_root(doc);
+	pag_dict *catalog = ref != NULL
+		? pag_obj2dict(pag_get_indirect_obj(doc, *ref)) : NULL;
+	if (catalog == NULL)
+		return NULL;
+	pag_object *labels = pag_dict_get(catalog, pag_make_name("PageLabels"));
+	if (labels == NULL)
+		return NULL;
+	return pag_compile_pagelabels(labels, doc, pag_count_pages(doc));
+}
+
+void
+pag_free_pagelabels(pag_pagelabels *pl)
+{
+	if (pl == NULL)
+		return;
+	for (size_t i=0; i<pl->len; i++)
+		free(pl->ranges[i].prefix);
+	free(pl->ranges);
+	free(pl->buckets);
+	free(pl);
+}
+
+pag_object *
+pag_pagelabels_tree(pag_document *doc, pag_pagelabels *pl, size_t leafsize)
+{
+	size_t n = pl != NULL ? pl->len : 0;
+	long *keys = malloc((n > 0 ? n : 1) * sizeof(long));
+	pag_object **vals = malloc((n > 0 ? n : 1) * sizeof(pag_object *));
+	for (size_t i=0; i<n; i++) {
+		struct _label_range *r = &pl->ranges[i];
+		pag_dict *dict = pag_make_empty_dict();
+		if (r->style != 0) {
+			char style[2] = {r->style, 0};
+			pag_dict_set(dict, pag_make_name("S"),
+				pag_name2obj(pag_make_name(style)));
+		}
+		if (r->prefix != NULL)
+			pag_dict_set(dict, pag_make_name("P"), pag_string2obj(
+				pag_make_string(r->prefix, r->prefixlen)));
+		if (r->start != 1)
+			pag_dict_set(dict, pag_make_name("St"),
+				pag_int2obj(pag_make_int(r->start)));
+		keys[i] = r->index;
+		vals[i] = pag_dict2obj(dict);
+	}
+	pag_object *tree = pag_make_number_tree(doc, keys, vals, n, leafsize);
+	free(keys);
+	free(vals);
+	return tree;
+}
+
+/* first page after range i */
+static long
+range_end(pag_pagelabels *pl, size_t i)
+{
+	if (i+1 < pl->len)
+		return pl->ranges[i+1].index;
+	return pl->nbpages >= 0 ? pl->nbpages : LONG_MAX;
+}
+
+/* Labels are written like snprintf, counting what did not fit. */
+struct _lbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void
+lput(struct _lbuf *b, char ch)
+{
+	if (b->len+1 < b->size)
+		b->buf[b->len] = ch;
+	b->len++;
+}
+
+static const struct {
+	long val;
+	char *str;
+} romans[] = {
+	{1000, "m"}, {900, "cm"}, {500, "d"}, {400, "cd"}, {100, "c"},
+	{90, "xc"}, {50, "l"}, {40, "xl"}, {10, "x"}, {9, "ix"}, {5, "v"},
+	{4, "iv"}, {1, "i"},
+};
+
+static void
+format_number(struct _lbuf *b, long n, char style)
+{
+	switch (style) {
+	case 'D': {
+		char digits[24];
+		int len = 0;
+		do {
+			digits[len++] = '0' + n%10;
+			n /= 10;
+		} while (n > 0);
+		while (len > 0)
+			lput(b, digits[--len]);
+		break;
+	}
+	case 'R': case 'r':
+		for (size_t i=0; i<sizeof(romans)/sizeof(romans[0]); i++)
+			for (; n >= romans[i].val; n -= romans[i].val)
+				for (char *s = romans[i].str; *s; s++)
+					lput(b, style == 'R' ? toupper(*s) : *s);
+		break;
+	case 'A': case 'a':
+		/* A to Z, then AA to ZZ, AAA to ZZZ, ... */
+		for (long i=0; i <= (n-1)/26; i++)
+			lput(b, (style == 'A' ? 'A' : 'a') + (n-1)%26);
+		break;
+	}
+}
+
+size_t
+pag_page_label(pag_pagelabels *pl, int index, char *buf, size_t size)
+{
+	struct _lbuf b = {buf, size, 0};
+
+	/* last range starting at or before index */
+	size_t lo = 0, hi = pl != NULL ? pl->len : 0;
+	while (lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		if (pl->ranges[mid].index <= index)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	if (lo == 0) {
+		format_number(&b, index+1L, 'D');
+	} else {
+		struct _label_range *r = &pl->ranges[lo-1];
+		for (size_t i=0; i<r->prefixlen; i++)
+			lput(&b, r->prefix[i]);
+		if (r->style != 0)
+			format_number(&b, r->start + (index - r->index),
+				r->style);
+	}
+	if (size > 0)
+		buf[b.len < size ? b.len : size-1] = '\0';
+	return b.len;
+}
+
+/* Number written as s in the given style, or -1 if it is not written the
+way format_number writes it. */
+static long
+parse_number(char *s, size_t len, char style)
+{
+	long n = 0;
+	switch (style) {
+	case 'D':
+		if (len == 0 || len > 18 || s[0] == '0')
+			return -1;
+		for (size_t i=0; i<len; i++) {
+			if (!isdigit((unsigned char)s[i]))
+				return -1;
+			n = 10*n + (s[i]-'0');
+		}
+		return n;
+	case 'R': case 'r': {
+		if (len == 0)
+			return -1;
+		size_t i = 0;
+		for (size_t k=0; k<sizeof(romans)/sizeof(romans[0]); k++) {
+			size_t l = strlen(romans[k].str);
+			/* repeating a numeral is only allowed for m, c, x, i */
+			while (i+l <= len) {
+				size_t j = 0;
+				while (j < l && s[i+j] == (style == 'R'
+				    ? toupper(romans[k].str[j])
+				    : romans[k].str[j]))
+					j++;
+				if (j < l)
+					break;
+				i += l;
+				n += romans[k].val;
+				if (l == 2 || romans[k].str[0] == 'd'
+				    || romans[k].str[0] == 'l'
+				    || romans[k].str[0] == 'v')
+					break;
+			}
+		}
+		if (i < len)
+			return -1;
+		/* only the canonical form maps back */
+		char *tmp = malloc(len+2);
+		struct _lbuf b = {tmp, len+2, 0};
+		format_number(&b, n, style);
+		int same = b.len == len && !memcmp(tmp, s, len);
+		free(tmp);
+		return same ? n : -1;
+	}
+	case 'A': case 'a': {
+		char first = style == 'A' ? 'A' : 'a';
+		if (len == 0 || s[0] < first || s[0] > first+25)
+			return -1;
+		for (size_t i=1; i<len; i++)
+			if (s[i] != s[0])
+				return -1;
+		return (long)(len-1)*26 + (s[0]-first) + 1;
+	}
+	}
+	return -1;
+}
+
+int
+pag_find_page_label(pag_pagelabels *pl, char *label)
+{
+	size_t len = strlen(label);
+	if (pl == NULL || pl->len == 0) {
+		long n = parse_number(label, len, 'D');
+		return n >= 1 && (pl == NULL || pl->nbpages < 0
+			|| n <= pl->nbpages) ? n-1 : -1;
+	}
+
+	for (size_t cut=0; cut<=len; cut++) {
+		size_t h = hash_prefix(label, cut) & (pl->nbuckets-1);
+		for (int i = pl->buckets[h]; i >= 0; i = pl->ranges[i].next) {
+			struct _label_range *r = &pl->ranges[i];
+			if (r->prefixlen != cut
+			    || (cut > 0 && memcmp(r->prefix, label, cut) != 0))
+				continue;
+			long n = r->start;
+			if (r->style != 0)
+				n = parse_number(label+cut, len-cut, r->style);
+			else if (cut != len)
+				continue;
+			long index = r->index + (n - r->start);
+			if (n >= r->start && index < range_end(pl, i))
+				return index;
+		}
+	}
+	return -1;
+}
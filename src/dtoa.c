@@ -0,0 +1,308 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include <stdint.h>
+#include <string.h>
+#include "pagina.h"
+
+/* Shortest decimal representation of doubles, with the Grisu2 algorithm
+(Florian Loitsch, "Printing floating-point numbers quickly and accurately
+with integers", 2010), laid out as in Milo Yip's implementation. The digits
+always read back to the same double, and are the shortest such digits in
+all but a tiny fraction of cases. The result is then written in PDF real
+syntax, which has no exponent. */
+
+typedef struct {
+	uint64_t f;
+	int e;
+} diy_fp;
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+/* normalized 10^k for k = -348, -340, ..., 340 */
+static const uint64_t cached_powers_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+	0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+	0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+	0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+	0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+	0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+	0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+	0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+	0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+	0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+	0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+	0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+	0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+	0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+	0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+	0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+	0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+	0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+	0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+	0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+	0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+	0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint32_t pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000,
+};
+
+static diy_fp
+fp_from_double(double d)
+{
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	int biased_e = (u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE;
+	uint64_t significand = u & DP_SIGNIFICAND_MASK;
+
+	diy_fp fp;
+	if (biased_e != 0) {
+		fp.f = significand + DP_HIDDEN_BIT;
+		fp.e = biased_e - DP_EXPONENT_BIAS;
+	} else {
+		fp.f = significand;
+		fp.e = DP_MIN_EXPONENT + 1;
+	}
+	return fp;
+}
+
+static diy_fp
+normalize(diy_fp x)
+{
+	while (!(x.f & (1ULL << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+static diy_fp
+multiply(diy_fp x, diy_fp y)
+{
+	const uint64_t m32 = 0xFFFFFFFFULL;
+	uint64_t a = x.f >> 32, b = x.f & m32;
+	uint64_t c = y.f >> 32, d = y.f & m32;
+	uint64_t ac = a*c, bc = b*c, ad = a*d, bd = b*d;
+	uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+	tmp += 1U << 31; /* round */
+
+	diy_fp r = {ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+	return r;
+}
+
+/* Boundaries m- and m+ of the interval of numbers that round to v. */
+static void
+normalized_boundaries(diy_fp v, diy_fp *minus, diy_fp *plus)
+{
+	diy_fp pl = {(v.f << 1) + 1, v.e - 1};
+	while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+		pl.f <<= 1;
+		pl.e--;
+	}
+	pl.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+	pl.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+	diy_fp mi;
+	if (v.f == DP_HIDDEN_BIT) {
+		mi.f = (v.f << 2) - 1;
+		mi.e = v.e - 2;
+	} else {
+		mi.f = (v.f << 1) - 1;
+		mi.e = v.e - 1;
+	}
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	*plus = pl;
+	*minus = mi;
+}
+
+static diy_fp
+cached_power(int e, int *k)
+{
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	if (ik != dk)
+		ik++;
+	unsigned index = (ik >> 3) + 1;
+	*k = -(-348 + (int)index*8);
+
+	diy_fp r = {cached_powers_f[index], cached_powers_e[index]};
+	return r;
+}
+
+static int
+count_digits(uint32_t n)
+{
+	int d = 1;
+	while (d < 10 && n >= pow10[d])
+		d++;
+	return d;
+}
+
+static void
+grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+		uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa
+	       && (rest + ten_kappa < wp_w
+		   || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len-1]--;
+		rest += ten_kappa;
+	}
+}
+
+static void
+digit_gen(diy_fp w, diy_fp mp, uint64_t delta, char *buf, int *len, int *k)
+{
+	diy_fp one = {1ULL << -mp.e, mp.e};
+	uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = mp.f >> -one.e;
+	uint64_t p2 = mp.f & (one.f - 1);
+	int kappa = count_digits(p1);
+	*len = 0;
+
+	while (kappa > 0) {
+		uint32_t d = p1 / pow10[kappa-1];
+		p1 %= pow10[kappa-1];
+		if (d || *len)
+			buf[(*len)++] = '0' + d;
+		kappa--;
+		uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+		if (tmp <= delta) {
+			*k += kappa;
+			grisu_round(buf, *len, delta, tmp,
+				(uint64_t)pow10[kappa] << -one.e, wp_w);
+			return;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = p2 >> -one.e;
+		if (d || *len)
+			buf[(*len)++] = '0' + d;
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			int index = -kappa;
+			grisu_round(buf, *len, delta, p2, one.f,
+				wp_w * (index < 10 ? pow10[index] : 0));
+			return;
+		}
+	}
+}
+
+/* Digits of a positive finite v, such that v = digits * 10^k. */
+static void
+grisu2(double v, char *buf, int *len, int *k)
+{
+	diy_fp fp = fp_from_double(v);
+	diy_fp wm, wp;
+	normalized_boundaries(fp, &wm, &wp);
+	diy_fp c_mk = cached_power(wp.e, k);
+	diy_fp w = multiply(normalize(fp), c_mk);
+	diy_fp mp = multiply(wp, c_mk);
+	diy_fp mm = multiply(wm, c_mk);
+	mm.f++;
+	mp.f--;
+	digit_gen(w, mp, mp.f - mm.f, buf, len, k);
+}
+
+/* Write v into out as a PDF real, without exponent, without leading zero
+before the point and without trailing zeros after it, e.g. "12.", ".5"
+or "-3.25". out must have room for PAG_REAL_BUFSIZE bytes. Return the
+length, or -1 for NaN and infinities, which PDF has no syntax for. */
+int
+pag_format_real(double v, char *out)
+{
+	int n = 0;
+	if (v != v || v - v != 0)
+		return -1;
+	if (v == 0) {
+		memcpy(out, "0.", 3);
+		return 2;
+	}
+	if (v < 0) {
+		out[n++] = '-';
+		v = -v;
+	}
+
+	char digits[24];
+	int len, k;
+	grisu2(v, digits, &len, &k);
+	while (len > 1 && digits[len-1] == '0') {
+		len--;
+		k++;
+	}
+
+	int point = len + k; /* position of the decimal point in digits */
+	if (point >= len) {
+		memcpy(out+n, digits, len);
+		n += len;
+		memset(out+n, '0', point-len);
+		n += point-len;
+		out[n++] = '.';
+	} else if (point > 0) {
+		memcpy(out+n, digits, point);
+		n += point;
+		out[n++] = '.';
+		memcpy(out+n, digits+point, len-point);
+		n += len-point;
+	} else {
+		out[n++] = '.';
+		memset(out+n, '0', -point);
+		n += -point;
+		memcpy(out+n, digits, len);
+		n += len;
+	}
+	out[n] = 0;
+	return n;
+}
@@ -0,0 +1,349 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pagina.h"
+
+/* Extraction reads from the source document only what the selected pages
+need: the page tree nodes on the way to each page, found through /Count,
+and the objects the pages reference. Those are copied into a new document,
+so the source is left as it was. */
+
+static char *inherited[] = {"Resources", "MediaBox", "CropBox", "Rotate"};
+#define NB_INHERITED (sizeof(inherited)/sizeof(inherited[0]))
+
+struct _extract {
+	pag_document *src;
+	unsigned int *newid; /* new id by source id, 0 if not copied */
+	pag_object **objs; /* copies, by new id - 1 */
+	unsigned int *srcids; /* their source ids, 0 for pages */
+	unsigned int len;
+	unsigned int cap;
+};
+
+static unsigned int
+ref_id(pag_object *obj)
+{
+	pag_ref *ref = pag_obj2ref(obj);
+	return ref != NULL ? ref->id : 0;
+}
+
+static pag_object *
+resolve(pag_document *doc, pag_object *obj)
+{
+	pag_ref *ref = pag_obj2ref(obj);
+	return ref != NULL ? pag_get_indirect_obj(doc, *ref) : obj;
+}
+
+static long
+node_count(pag_dict *dict)
+{
+	pag_object *count = pag_dict_get(dict, pag_make_name("Count"));
+	if (count == NULL || count->type != PAG_INT)
+		return -1;
+	return count->val.intv.val;
+}
+
+/* Find the page at index under page tree node, gathering the attributes it
+inherits. 0 if there is no such page. */
+static unsigned int
+find_page(pag_document *doc, unsigned int node, long index,
+		pag_object **attrs)
+{
+	for (int depth=0; depth < doc->len; depth++) {
+		pag_dict *dict = pag_obj2dict(pag_load_object(doc, node));
+		if (dict == NULL)
+			return 0;
+		for (size_t i=0; i<NB_INHERITED; i++) {
+			pag_object *obj = pag_dict_get(dict,
+				pag_make_name(inherited[i]));
+			if (obj != NULL)
+				attrs[i] = obj;
+		}
+
+		pag_object *kids = resolve(doc, pag_dict_get(dict,
+			pag_make_name("Kids")));
+		if (kids == NULL || kids->type != PAG_ARRAY)
+			return index == 0 ? node : 0;
+
+		/* kids are read even when /Count is their number: an empty
+		node next to a node of two pages adds up the same */
+		unsigned int next = 0;
+		for (pag_array *a = kids->val.array; a != NULL && next == 0;
+		    a = a->next) {
+			unsigned int id = ref_id(a->val);
+			pag_dict *kid = pag_obj2dict(pag_load_object(doc, id));
+			if (kid == NULL)
+				continue;
+			long n = pag_dict_get(kid, pag_make_name("Kids"))
+				!= NULL ? node_count(kid) : 1;
+			if (n < 0)
+				return 0; /* intermediate node without /Count */
+			if (index < n)
+				next = id;
+			else
+				index -= n;
+		}
+		if (next == 0)
+			return 0;
+		node = next;
+	}
+	return 0;
+}
+
+static unsigned int
+add_object(struct _extract *x, pag_object *obj, unsigned int srcid)
+{
+	if (x->len == x->cap) {
+		x->cap = x->cap ? 2*x->cap : 64;
+		x->objs = realloc(x->objs, x->cap * sizeof(pag_object *));
+		x->srcids = realloc(x->srcids, x->cap * sizeof(unsigned int));
+	}
+	x->objs[x->len] = obj;
+	x->srcids[x->len++] = srcid;
+	return x->len;
+}
+
+static void
+visit_ref(pag_ref *ref, void *arg)
+{
+	struct _extract *x = arg;
+	unsigned int id = ref->id;
+	if (id < 1 || id > (unsigned)x->src->len || x->newid[id] != 0)
+		return;
+	/* other pages and the page tree are left out, references to them
+	become null */
+	pag_object *obj = pag_get_indirect_obj(x->src, *ref);
+	if (obj == NULL || pag_is_page_node(obj))
+		return;
+	x->newid[id] = add_object(x, pag_copy_object(obj), id);
+}
+
+static pag_object *
+make_ref_obj(unsigned int id)
+{
+	return pag_ref2obj(pag_make_ref(id, 0, NULL));
+}
+
+static pag_document *
+make_extracted(struct _extract *x, pag_page *pages, int n,
+		unsigned int info)
+{
+	pag_dict *catalog = pag_make_empty_dict();
+	pag_dict_set(catalog, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("Catalog")));
+	pag_dict_set(catalog, pag_make_name("Pages"), make_ref_obj(2));
+	x->objs[0] = pag_dict2obj(catalog);
+
+	pag_array *kids = NULL, *last = NULL;
+	for (int i=0; i<n; i++) {
+		pag_array *node = pag_make_array_single(
+			make_ref_obj(pages[i].id));
+		if (last == NULL)
+			kids = node;
+		else
+			last->next = node;
+		last = node;
+	}
+	pag_dict *root = pag_make_empty_dict();
+	pag_dict_set(root, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("Pages")));
+	pag_dict_set(root, pag_make_name("Kids"), pag_array2obj(kids));
+	pag_dict_set(root, pag_make_name("Count"),
+		pag_int2obj(pag_make_int(n)));
+	x->objs[1] = pag_dict2obj(root);
+
+	pag_dict *trailer = pag_make_empty_dict();
+	pag_dict_set(trailer, pag_make_name("Size"),
+		pag_int2obj(pag_make_int(x->len+1)));
+	pag_dict_set(trailer, pag_make_name("Root"), make_ref_obj(1));
+	if (info != 0)
+		pag_dict_set(trailer, pag_make_name("Info"),
+			make_ref_obj(info));
+
+	pag_document *doc = calloc(1, sizeof(pag_document));
+	doc->len = x->len;
+	doc->version = x->src->version;
+	doc->objs = calloc(x->len, sizeof(pag_ref));
+	doc->trailer_dicts = pag_make_array_single(pag_dict2obj(trailer));
+	doc->table.len = x->len+1;
+	doc->table.table = calloc(x->len+1, sizeof(pag_xref_entry));
+	doc->cache = pag_make_stream_cache();
+	doc->fd = -1;
+	doc->dirty = malloc(x->len+1);
+	memset(doc->dirty, 1, x->len+1);
+	for (unsigned int id=1; id <= x->len; id++) {
+		pag_object *obj = x->objs[id-1];
+		if (obj->type == PAG_STREAM) {
+			obj->val.stream->id = id;
+			obj->val.stream->cache = doc->cache;
+		}
+		pag_set_owner(obj, doc, id);
+		doc->objs[id-1] = pag_make_ref(id, 0, obj);
+	}
+
+	pag_page **list = malloc((n+1) * sizeof(pag_page *));
+	for (int i=0; i<n; i++) {
+		pag_dict *dict = pages[i].dict;
+		pag_dict_set(dict, pag_make_name("Parent"), make_ref_obj(2));
+		pag_object *attrs[NB_INHERITED];
+		for (size_t j=0; j<NB_INHERITED; j++)
+			attrs[j] = pag_dict_get(dict,
+				pag_make_name(inherited[j]));
+		pages[i].resources = attrs[0];
+		pages[i].mediabox = attrs[1];
+		pages[i].cropbox = attrs[2];
+		pages[i].rotate = attrs[3];
+		list[i] = &pages[i];
+	}
+	list[n] = NULL;
+	doc->pagetree = pag_make_pagetree(list);
+	doc->pagetree->doc = doc;
+	doc->pagetree->root = 2;
+	free(list);
+	return doc;
+}
+
+pag_document *
+pag_extract_pages(pag_document *doc, int *pages, int n)
+{
+	pag_dict *tdict = doc->trailer_dicts->val->val.dict;
+	pag_ref *rootref = pag_get_root(doc);
+	pag_dict *catalog = rootref != NULL
+		? pag_obj2dict(pag_get_indirect_obj(doc, *rootref)) : NULL;
+	unsigned int root = catalog != NULL
+		? ref_id(pag_dict_get(catalog, pag_make_name("Pages"))) : 0;
+	/* encrypted strings could not be copied as they are */
+	if (root == 0 || pag_dict_get(tdict, pag_make_name("Encrypt")) != NULL)
+		return NULL;
+
+	struct _extract x = {.src=doc};
+	x.newid = calloc(doc->len+1, sizeof(unsigned int));
+	pag_page *out = calloc(n > 0 ? n : 1, sizeof(pag_page));
+
+	/* ids 1 and 2 are for the catalog and the page tree root */
+	add_object(&x, NULL, 0);
+	add_object(&x, NULL, 0);
+	for (int i=0; i<n; i++) {
+		pag_object *attrs[NB_INHERITED] = {0};
+		unsigned int id = find_page(doc, root, pages[i], attrs);
+		pag_object *page = pag_load_object(doc, id);
+		if (pag_obj2dict(page) == NULL) {
+			free(x.newid);
+			free(x.objs);
+			free(x.srcids);
+			free(out);
+			return NULL;
+		}
+
+		/* a page may be taken more than once, each time as a new
+		object */
+		page = pag_copy_object(page);
+		pag_dict *dict = page->val.dict;
+		pag_dict_set(dict, pag_make_name("Parent"), NULL);
+		for (size_t j=0; j<NB_INHERITED; j++) {
+			pag_name name = pag_make_name(inherited[j]);
+			if (attrs[j] != NULL && pag_dict_get(dict, name) == NULL)
+				pag_dict_set(dict, name,
+					pag_copy_object(attrs[j]));
+		}
+		out[i].id = add_object(&x, page, 0);
+		out[i].parent = 2;
+		out[i].dict = dict;
+		if (x.newid[id] == 0)
+			x.newid[id] = out[i].id;
+	}
+
+	pag_ref *info = pag_get_info(doc);
+	if (info != NULL)
+		visit_ref(info, &x);
+	/* if the document has a reference index, the objects other than the
+	pages, which get inherited attributes, need not be walked */
+	for (unsigned int i=2; i < x.len; i++) {
+		if (doc->refindex == NULL || x.srcids[i] == 0) {
+			pag_for_each_ref(x.objs[i], visit_ref, &x);
+			continue;
+		}
+		unsigned int *ids;
+		size_t len = pag_refs_from(doc->refindex, x.srcids[i], &ids);
+		for (size_t j=0; j<len; j++)
+			visit_ref(&(pag_ref){.id=ids[j]}, &x);
+	}
+	for (unsigned int i=2; i < x.len; i++)
+		pag_renumber_refs(x.objs[i], x.newid, doc->len);
+
+	pag_document *res = make_extracted(&x, out, n,
+		info != NULL ? x.newid[info->id] : 0);
+	free(x.newid);
+	free(x.objs);
+	free(x.srcids);
+	free(out);
+	return res;
+}
+
+int *
+pag_parse_page_range(char *spec, int nbpages, int *len)
+{
+	size_t n = 0, cap = 16;
+	int *pages = malloc(cap * sizeof(int));
+	char *s = spec;
+	for (;;) {
+		long first = 1, last = nbpages;
+		if (isdigit((unsigned char)*s))
+			first = strtol(s, &s, 10);
+		else if (*s != '-')
+			goto err;
+		if (*s == '-') {
+			s++;
+			if (isdigit((unsigned char)*s))
+				last = strtol(s, &s, 10);
+		} else {
+			last = first;
+		}
+		if (first < 1 || first > nbpages || last < 1 || last > nbpages)
+			goto err;
+
+		/* a decreasing range gives the pages in reverse */
+		long step = first <= last ? 1 : -1;
+		for (long p=first; ; p += step) {
+			if (n == cap) {
+				cap *= 2;
+				pages = realloc(pages, cap * sizeof(int));
+			}
+			pages[n++] = p-1;
+			if (p == last)
+				break;
+		}
+
+		if (*s == '\0')
+			break;
+		if (*s++ != ',')
+			goto err;
+	}
+	*len = n;
+	return pages;
+
+err:
+	free(pages);
+	return NULL;
+}
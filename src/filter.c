@@ -18,4 +18,509 @@ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
 LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
 FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.
-*/
\ No newline at end of file
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "pagina.h"
+
+#define DEFLATE_BLOCK_SIZE (128*1024)
+#define DEFLATE_DICT_SIZE (32*1024)
+
+
+/**** Flate filter ****/
+
+char *
+pag_flate_decode(char *buf, size_t len, size_t *outlen)
+{
+	z_stream zs = {0};
+	if (inflateInit(&zs) != Z_OK)
+		return NULL;
+
+	size_t cap = 4*len + 64, n = 0;
+	char *out = malloc(cap+1);
+	zs.next_in = (unsigned char *)buf;
+	zs.avail_in = len;
+
+	int ret;
+	do {
+		if (n == cap) {
+			cap *= 2;
+			out = realloc(out, cap+1);
+		}
+		zs.next_out = (unsigned char *)out + n;
+		zs.avail_out = cap - n;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		n = cap - zs.avail_out;
+	} while (ret == Z_OK);
+	inflateEnd(&zs);
+
+	/* tolerate truncated data, as most readers do */
+	if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && zs.avail_in == 0)) {
+		free(out);
+		return NULL;
+	}
+
+	out[n] = 0; /* null-terminated for safety */
+	*outlen = n;
+	return out;
+}
+
+char *
+pag_flate_encode(char *buf, size_t len, int level, size_t *outlen)
+{
+	uLongf n = compressBound(len);
+	char *out = malloc(n);
+	if (compress2((unsigned char *)out, &n, (unsigned char *)buf, len,
+			level) != Z_OK) {
+		free(out);
+		return NULL;
+	}
+	*outlen = n;
+	return out;
+}
+
+
+/**** stream decoding ****/
+
+static char *
+hex_decode(char *buf, size_t len, size_t *outlen)
+{
+	char *out = malloc(len/2 + 2);
+	size_t n = 0;
+	int half = 0;
+	unsigned char acc = 0;
+	for (size_t i=0; i<len && buf[i]!='>'; i++) {
+		char ch = buf[i];
+		int v;
+		if ('0' <= ch && ch <= '9')
+			v = ch-'0';
+		else if ('a' <= ch && ch <= 'f')
+			v = 10+ch-'a';
+		else if ('A' <= ch && ch <= 'F')
+			v = 10+ch-'A';
+		else
+			continue; /* whitespace */
+		acc = 16*acc + v;
+		if (half)
+			out[n++] = acc;
+		half = !half;
+	}
+	if (half)
+		out[n++] = 16*acc;
+	out[n] = 0;
+	*outlen = n;
+	return out;
+}
+
+static char *
+apply_filter(pag_object *filter, pag_object *parms, char *buf, size_t len,
+		size_t *outlen)
+{
+	if (filter == NULL || filter->type != PAG_NAME)
+		return NULL;
+	if (parms != NULL && parms->type == PAG_DICT) {
+		/* predictors are not supported yet */
+		pag_object *pred = pag_dict_get(parms->val.dict,
+			pag_make_name("Predictor"));
+		if (pred != NULL && (pred->type != PAG_INT
+				|| pred->val.intv.val > 1))
+			return NULL;
+	}
+
+	char *name = filter->val.name.str;
+	if (!strcmp(name, "FlateDecode") || !strcmp(name, "Fl"))
+		return pag_flate_decode(buf, len, outlen);
+	if (!strcmp(name, "ASCIIHexDecode") || !strcmp(name, "AHx"))
+		return hex_decode(buf, len, outlen);
+	return NULL;
+}
+
+/* Run the whole filter chain of a stream, returning a new buffer. */
+static char *
+decode_stream(pag_stream *stream, size_t *len)
+{
+	pag_object *filter = pag_dict_get(stream->dict, pag_make_name("Filter"));
+	pag_object *parms = pag_dict_get(stream->dict,
+		pag_make_name("DecodeParms"));
+
+	pag_array *filters = filter->type == PAG_ARRAY
+		? filter->val.array : pag_make_array_single(filter);
+	pag_array *parmsarr = parms != NULL && parms->type == PAG_ARRAY
+		? parms->val.array : pag_make_array_single(parms);
+
+	char *raw = stream->stream;
+	if (raw == NULL)
+		raw = pag_load_raw_stream(stream);
+	if (raw == NULL)
+		return NULL;
+
+	char *buf = raw;
+	size_t n = stream->len;
+	for (; filters != NULL; filters = filters->next) {
+		size_t outlen;
+		pag_object *p = parmsarr != NULL ? parmsarr->val : NULL;
+		char *out = apply_filter(filters->val, p, buf, n, &outlen);
+		if (buf != stream->stream)
+			free(buf);
+		if (out == NULL)
+			return NULL;
+		buf = out;
+		n = outlen;
+		if (parmsarr != NULL)
+			parmsarr = parmsarr->next;
+	}
+
+	if (buf == stream->stream) { /* empty filter array */
+		buf = malloc(n+1);
+		memcpy(buf, stream->stream, n);
+		buf[n] = 0;
+	}
+	*len = n;
+	return buf;
+}
+
+char *
+pag_borrow_stream(pag_stream *stream, size_t *len)
+{
+	if (stream->decoded != NULL) {
+		*len = stream->decoded_len;
+		return stream->decoded;
+	}
+
+	if (pag_dict_get(stream->dict, pag_make_name("Filter")) == NULL) {
+		*len = stream->len;
+		return pag_read_raw_stream(stream);
+	}
+
+	char *data = pag_cache_get(stream->cache, stream->id, len);
+	if (data != NULL)
+		return data;
+
+	data = decode_stream(stream, len);
+	if (data == NULL)
+		return NULL;
+	if (stream->cache == NULL) {
+		free(stream->view);
+		stream->view = data;
+		return data;
+	}
+	return pag_cache_put(stream->cache, stream->id, data, *len);
+}
+
+char *
+pag_read_stream(pag_stream *stream, size_t *len)
+{
+	char *view = pag_borrow_stream(stream, len);
+	if (view == NULL)
+		return NULL;
+
+	char *copy = malloc(*len+1);
+	memcpy(copy, view, *len);
+	copy[*len] = 0;
+	return copy;
+}
+
+void
+pag_stream_set_data(pag_stream *stream, char *buf, size_t len)
+{
+	pag_cache_drop(stream->cache, stream->id);
+	if (stream->dict->doc != NULL)
+		pag_mark_dirty(stream->dict->doc, stream->dict->id);
+	free(stream->decoded);
+	stream->decoded = buf;
+	stream->decoded_len = len;
+}
+
+/* Encode modified data into the raw data. A stream that had filters is
+written with the Flate filter only, since that is the only encoder we
+have; one that had none is left unencoded. */
+int
+pag_encode_stream(pag_stream *stream)
+{
+	if (stream->decoded == NULL)
+		return 0;
+
+	char *raw;
+	size_t len;
+	pag_dict *dict = stream->dict;
+	if (pag_dict_get(dict, pag_make_name("Filter")) == NULL) {
+		raw = stream->decoded;
+		len = stream->decoded_len;
+	} else {
+		raw = pag_flate_encode(stream->decoded, stream->decoded_len,
+			Z_DEFAULT_COMPRESSION, &len);
+		if (raw == NULL)
+			return -1;
+		pag_dict_set(dict, pag_make_name("Filter"),
+			pag_name2obj(pag_make_name("FlateDecode")));
+		pag_dict_set(dict, pag_make_name("DecodeParms"), NULL);
+		/* the decoded data is still good, keep it around */
+		pag_cache_put(stream->cache, stream->id, stream->decoded,
+			stream->decoded_len);
+	}
+
+	if (stream->fd >= 0) /* loaded by pag_read_raw_stream */
+		free(stream->stream);
+	stream->stream = raw;
+	stream->len = len;
+	stream->decoded = NULL;
+	stream->decoded_len = 0;
+	pag_dict_set(dict, pag_make_name("Length"),
+		pag_int2obj(pag_make_int(len)));
+	return 0;
+}
+
+
+/**** parallel stream compression ****/
+
+/* Streams are cut into blocks that are deflated independently, each one
+primed with the last 32K of the previous block and ended with a sync flush,
+so that the raw deflate blocks can simply be concatenated (as pigz does).
+Block boundaries only depend on the data, so the output does not depend on
+the number of threads. */
+
+struct _zjob {
+	pag_stream *stream;
+	char *data;	/* data to compress */
+	size_t len;
+	int owned;	/* data was decoded here and must be freed */
+	int refilter;	/* stream is already Flate-encoded */
+	int dirty;	/* data is the stream's modified data */
+	size_t first;	/* index of the first block */
+	size_t nblocks;
+};
+
+struct _zblock {
+	struct _zjob *job;
+	size_t start;
+	size_t len;
+	int last;
+	char *out;
+	size_t outlen;
+	unsigned long adler;
+};
+
+struct _zctx {
+	struct _zjob *jobs;
+	struct _zblock *blocks;
+	int level;
+};
+
+static int
+is_flate(pag_object *filter)
+{
+	if (filter == NULL)
+		return 0;
+	if (filter->type == PAG_ARRAY && pag_array_len(filter->val.array) == 1)
+		filter = filter->val.array->val;
+	return filter->type == PAG_NAME
+		&& !strcmp(filter->val.name.str, "FlateDecode");
+}
+
+static int
+should_compress(pag_stream *stream, int *refilter)
+{
+	pag_dict *dict = stream->dict;
+	pag_object *type = pag_dict_get(dict, pag_make_name("Type"));
+	/* keep XMP metadata readable by tools that do not know PDF */
+	if (type != NULL && type->type == PAG_NAME
+			&& !strcmp(type->val.name.str, "Metadata"))
+		return 0;
+
+	pag_object *filter = pag_dict_get(dict, pag_make_name("Filter"));
+	*refilter = filter != NULL;
+	if (filter == NULL)
+		return 1;
+	return is_flate(filter)
+		&& pag_dict_get(dict, pag_make_name("DecodeParms")) == NULL;
+}
+
+static void
+load_job(void *arg, size_t i)
+{
+	struct _zjob *job = &((struct _zjob *)arg)[i];
+	if (job->dirty) {
+		job->data = job->stream->decoded;
+		job->len = job->stream->decoded_len;
+		return;
+	}
+
+	char *raw = pag_read_raw_stream(job->stream);
+	job->data = NULL;
+	if (raw == NULL)
+		return;
+
+	if (!job->refilter) {
+		job->data = raw;
+		job->len = job->stream->len;
+		return;
+	}
+
+	job->data = pag_flate_decode(raw, job->stream->len, &job->len);
+	job->owned = 1;
+}
+
+static void
+deflate_block(void *arg, size_t i)
+{
+	struct _zctx *ctx = arg;
+	struct _zblock *b = &ctx->blocks[i];
+	unsigned char *in = (unsigned char *)b->job->data + b->start;
+
+	z_stream zs = {0};
+	b->out = NULL;
+	if (deflateInit2(&zs, ctx->level, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+	if (b->start > 0) {
+		size_t dictlen = b->start < DEFLATE_DICT_SIZE
+			? b->start : DEFLATE_DICT_SIZE;
+		deflateSetDictionary(&zs, in - dictlen, dictlen);
+	}
+
+	size_t cap = deflateBound(&zs, b->len) + 16;
+	b->out = malloc(cap);
+	zs.next_in = in;
+	zs.avail_in = b->len;
+	zs.next_out = (unsigned char *)b->out;
+	zs.avail_out = cap;
+	int ret = deflate(&zs, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+	while (zs.avail_out == 0 && ret != Z_STREAM_END) {
+		b->out = realloc(b->out, 2*cap);
+		zs.next_out = (unsigned char *)b->out + cap;
+		zs.avail_out = cap;
+		cap *= 2;
+		ret = deflate(&zs, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+	}
+	b->outlen = cap - zs.avail_out;
+	deflateEnd(&zs);
+
+	b->adler = adler32(1, in, b->len);
+}
+
+/* zlib header for a given level, as deflateInit would write it */
+static unsigned
+zlib_header(int level)
+{
+	unsigned flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+	unsigned h = (0x78 << 8) | (flags << 6);
+	return h + 31 - h%31;
+}
+
+/* Concatenate the blocks of a job into a zlib stream. */
+static char *
+assemble_job(struct _zctx *ctx, struct _zjob *job, size_t *outlen)
+{
+	size_t len = 2 + 4;
+	for (size_t i=0; i<job->nblocks; i++) {
+		if (ctx->blocks[job->first+i].out == NULL)
+			return NULL;
+		len += ctx->blocks[job->first+i].outlen;
+	}
+
+	char *out = malloc(len);
+	unsigned h = zlib_header(ctx->level);
+	out[0] = h >> 8;
+	out[1] = h & 0xff;
+
+	size_t n = 2;
+	unsigned long adler = 1;
+	for (size_t i=0; i<job->nblocks; i++) {
+		struct _zblock *b = &ctx->blocks[job->first+i];
+		memcpy(out+n, b->out, b->outlen);
+		n += b->outlen;
+		adler = adler32_combine(adler, b->adler, b->len);
+	}
+	out[n++] = adler >> 24;
+	out[n++] = adler >> 16;
+	out[n++] = adler >> 8;
+	out[n++] = adler;
+
+	*outlen = n;
+	return out;
+}
+
+int
+pag_compress_streams(pag_document *doc, int level, int threads)
+{
+	if (level < 1 || level > 9 || pag_load_all(doc) < 0)
+		return -1;
+
+	size_t njobs = 0;
+	struct _zjob *jobs = calloc(doc->len, sizeof(struct _zjob));
+	for (int i=0; i<doc->len; i++) {
+		pag_object *obj = doc->objs[i].obj;
+		int refilter;
+		if (obj == NULL || obj->type != PAG_STREAM
+				|| !should_compress(obj->val.stream, &refilter))
+			continue;
+		jobs[njobs].stream = obj->val.stream;
+		jobs[njobs].refilter = refilter;
+		jobs[njobs].dirty = obj->val.stream->decoded != NULL;
+		njobs++;
+	}
+
+	pag_parallel_for(threads, njobs, load_job, jobs);
+
+	size_t nblocks = 0;
+	for (size_t i=0; i<njobs; i++) {
+		jobs[i].first = nblocks;
+		jobs[i].nblocks = jobs[i].data == NULL ? 0
+			: jobs[i].len / DEFLATE_BLOCK_SIZE + 1;
+		nblocks += jobs[i].nblocks;
+	}
+
+	struct _zblock *blocks = calloc(nblocks, sizeof(struct _zblock));
+	for (size_t i=0; i<njobs; i++) {
+		for (size_t j=0; j<jobs[i].nblocks; j++) {
+			struct _zblock *b = &blocks[jobs[i].first+j];
+			b->job = &jobs[i];
+			b->start = j*DEFLATE_BLOCK_SIZE;
+			b->last = j+1 == jobs[i].nblocks;
+			b->len = b->last ? jobs[i].len - b->start
+				: DEFLATE_BLOCK_SIZE;
+		}
+	}
+
+	struct _zctx ctx = {.jobs=jobs, .blocks=blocks, .level=level};
+	pag_parallel_for(threads, nblocks, deflate_block, &ctx);
+
+	for (size_t i=0; i<njobs; i++) {
+		struct _zjob *job = &jobs[i];
+		size_t len;
+		char *out = job->data ? assemble_job(&ctx, job, &len) : NULL;
+
+		/* unmodified data is only replaced if it shrinks */
+		if (out != NULL && (job->dirty || len < job->stream->len)) {
+			pag_stream *stream = job->stream;
+			if (stream->fd >= 0) /* loaded by pag_read_raw_stream */
+				free(stream->stream);
+			stream->stream = out;
+			stream->len = len;
+			pag_dict_set(stream->dict, pag_make_name("Length"),
+				pag_int2obj(pag_make_int(len)));
+			pag_dict_set(stream->dict, pag_make_name("Filter"),
+				pag_name2obj(pag_make_name("FlateDecode")));
+			if (job->dirty) {
+				pag_dict_set(stream->dict,
+					pag_make_name("DecodeParms"), NULL);
+				pag_cache_put(stream->cache, stream->id,
+					stream->decoded, stream->decoded_len);
+				stream->decoded = NULL;
+				stream->decoded_len = 0;
+			}
+		} else {
+			free(out);
+		}
+
+		if (job->owned)
+			free(job->data);
+		for (size_t j=0; j<job->nblocks; j++)
+			free(blocks[job->first+j].out);
+	}
+
+	free(blocks);
+	free(jobs);
+	return 0;
+}
@@ -0,0 +1,304 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pagina.h"
+
+/* A sidecar index holds what pag_open_file reads from a file, and its page
+list, laid out as they are in memory: a header, the cross-reference table
+as doc->table holds it, one record per page, then the trailers in PDF
+syntax. It is mapped when opening, and the table used in place, so that
+only the parts that are used get read.
+
+An index is valid for the file with the size, modification time and hash
+of its first and last bytes it records. It is written by the library that
+reads it, hence in native byte order and with the table entry size
+recorded, to be rejected by a different build. */
+
+#define INDEX_MAGIC "PAGIDX1\n"
+#define INDEX_ORDER 0x01020304
+#define HASHED_BYTES 4096
+
+struct _index_header {
+	char magic[8];
+	uint32_t order;
+	uint32_t entrysize;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	int64_t start_offset;
+	int64_t startxref;
+	uint32_t version;
+	uint32_t len; /* number of objects */
+	uint32_t root; /* root page tree node, 0 if there is no page list */
+	uint32_t npages;
+	uint32_t ntrailers;
+	uint32_t unused;
+	uint64_t trailersize;
+};
+
+struct _index_page {
+	uint32_t id;
+	uint32_t parent;
+	uint32_t from[4];
+};
+
+static size_t
+table_size(struct _index_header *h)
+{
+	return ((size_t)h->len+1) * h->entrysize;
+}
+
+static struct _index_page *
+index_pages(struct _index_header *h)
+{
+	return (struct _index_page *)((char *)h + sizeof(*h) + table_size(h));
+}
+
+/* Fill in the size, modification time and hash of the file. */
+static int
+file_key(int fd, struct _index_header *h)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -1;
+	h->size = st.st_size;
+	h->mtime = st.st_mtim.tv_sec;
+	h->mtime_nsec = st.st_mtim.tv_nsec;
+
+	char buf[HASHED_BYTES];
+	off_t offs[2] = {0, st.st_size > HASHED_BYTES
+		? st.st_size - HASHED_BYTES : 0};
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	for (int i=0; i<2; i++) {
+		ssize_t n = pread(fd, buf, sizeof(buf), offs[i]);
+		if (n < 0)
+			return -1;
+		for (ssize_t j=0; j<n; j++)
+			hash = (hash ^ (unsigned char)buf[j]) * 1099511628211ULL;
+	}
+	h->hash = hash;
+	return 0;
+}
+
+static int
+write_index(pag_document *doc, char *path, char *ipath)
+{
+	struct _index_header h = {0};
+	if (file_key(doc->fd, &h) != 0 || doc->table.len < (size_t)doc->len+1)
+		return -1;
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.order = INDEX_ORDER;
+	h.entrysize = sizeof(pag_xref_entry);
+	h.start_offset = doc->start_offset;
+	h.startxref = doc->startxref;
+	h.version = doc->version;
+	h.len = doc->len;
+
+	pag_pagetree *tree = pag_get_pagetree(doc);
+	if (tree != NULL) {
+		h.root = tree->root;
+		h.npages = tree->len;
+	}
+
+	size_t ntrailers = 0;
+	for (pag_array *t = doc->trailer_dicts; t != NULL; t = t->next)
+		ntrailers++;
+	char **trailers = malloc((ntrailers > 0 ? ntrailers : 1)
+		* sizeof(char *));
+	size_t i = 0;
+	for (pag_array *t = doc->trailer_dicts; t != NULL; t = t->next) {
+		if ((trailers[i] = pag_obj2cstring(t->val)) == NULL)
+			break;
+		h.trailersize += strlen(trailers[i++]) + 1;
+	}
+	size_t nstrings = i;
+	h.ntrailers = ntrailers;
+
+	/* written aside, then renamed over the old index */
+	char *tmp = malloc(strlen(path) + 32);
+	sprintf(tmp, "%s.pagidx.%ld", path, (long)getpid());
+	FILE *out = nstrings == ntrailers ? fopen(tmp, "wb") : NULL;
+	int ret = -1;
+	if (out != NULL) {
+		fwrite(&h, sizeof(h), 1, out);
+		fwrite(doc->table.table, h.entrysize, (size_t)h.len+1, out);
+		for (i=0; i<h.npages; i++) {
+			pag_page *page = &tree->pages[i];
+			struct _index_page rec = {page->id, page->parent,
+				{page->from[0], page->from[1], page->from[2],
+				page->from[3]}};
+			fwrite(&rec, sizeof(rec), 1, out);
+		}
+		for (i=0; i<ntrailers; i++) {
+			fputs(trailers[i], out);
+			fputc('\n', out);
+		}
+		ret = ferror(out) ? -1 : 0;
+		if (fclose(out) != 0)
+			ret = -1;
+		if (ret == 0)
+			ret = rename(tmp, ipath);
+		if (ret != 0)
+			remove(tmp);
+	}
+
+	for (i=0; i<nstrings; i++)
+		free(trailers[i]);
+	free(trailers);
+	free(tmp);
+	return ret;
+}
+
+static int
+valid_index(struct _index_header *h, size_t len, int fd)
+{
+	if (len < sizeof(*h) || memcmp(h->magic, INDEX_MAGIC,
+	    sizeof(h->magic)) != 0 || h->order != INDEX_ORDER
+	    || h->entrysize != sizeof(pag_xref_entry) || h->ntrailers < 1)
+		return 0;
+	if (sizeof(*h) + table_size(h) + (size_t)h->npages
+	    * sizeof(struct _index_page) + h->trailersize != len)
+		return 0;
+	struct _index_header key;
+	return file_key(fd, &key) == 0 && key.size == h->size
+		&& key.mtime == h->mtime && key.mtime_nsec == h->mtime_nsec
+		&& key.hash == h->hash;
+}
+
+static pag_document *
+read_index(FILE *input, char *ipath)
+{
+	int fd = open(ipath, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	char *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+			fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	struct _index_header *h = (struct _index_header *)map;
+	if (!valid_index(h, st.st_size, fileno(input))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	pag_document *doc = calloc(1, sizeof(pag_document));
+	doc->index = map;
+	doc->indexlen = st.st_size;
+	doc->start_offset = h->start_offset;
+	doc->startxref = h->startxref;
+	doc->version = h->version;
+	doc->len = h->len;
+	doc->table.len = (size_t)h->len+1;
+	doc->table.table = (pag_xref_entry *)(map + sizeof(*h));
+	doc->objs = calloc(h->len > 0 ? h->len : 1, sizeof(pag_ref));
+	doc->dirty = calloc((size_t)h->len+1, 1);
+	doc->cache = pag_make_stream_cache();
+	doc->fd = fileno(input);
+	doc->input = input;
+
+	char *trailers = (char *)index_pages(h)
+		+ (size_t)h->npages * sizeof(struct _index_page);
+	FILE *f = fmemopen(trailers, h->trailersize, "r");
+	for (uint32_t i=0; f != NULL && i<h->ntrailers; i++) {
+		pag_object *obj = pag_parse(f);
+		if (obj == NULL || obj->type != PAG_DICT) {
+			fclose(f);
+			f = NULL;
+			break;
+		}
+		doc->trailer_dicts = pag_array_append(doc->trailer_dicts, obj);
+	}
+	if (f == NULL) {
+		pag_free_document(doc);
+		return NULL;
+	}
+	fclose(f);
+	return doc;
+}
+
+pag_document *
+pag_open_indexed(FILE *input, char *path)
+{
+	char *ipath = malloc(strlen(path) + sizeof(".pagidx"));
+	sprintf(ipath, "%s.pagidx", path);
+	pag_document *doc = read_index(input, ipath);
+	if (doc == NULL) {
+		doc = pag_open_file(input);
+		if (doc != NULL)
+			write_index(doc, path, ipath);
+	}
+	free(ipath);
+	return doc;
+}
+
+/* The page list of an index, with every page unread. */
+pag_pagetree *
+pag_index_pagetree(pag_document *doc)
+{
+	struct _index_header *h = (struct _index_header *)doc->index;
+	if (h->root == 0)
+		return NULL;
+	struct _index_page *recs = index_pages(h);
+	pag_pagetree *tree = calloc(1, sizeof(pag_pagetree));
+	tree->doc = doc;
+	tree->root = h->root;
+	tree->len = h->npages;
+	tree->cap = tree->len > 0 ? tree->len : 1;
+	tree->pages = calloc(tree->cap, sizeof(pag_page));
+	for (size_t i=0; i<tree->len; i++) {
+		pag_page *page = &tree->pages[i];
+		page->id = recs[i].id;
+		page->parent = recs[i].parent;
+		memcpy(page->from, recs[i].from, sizeof(page->from));
+		page->unread = 1;
+	}
+	return tree;
+}
+
+int
+pag_in_index(pag_document *doc, void *p)
+{
+	return doc->index != NULL && (char *)p >= doc->index
+		&& (char *)p < doc->index + doc->indexlen;
+}
+
+void
+pag_unmap_index(pag_document *doc)
+{
+	if (doc->index != NULL)
+		munmap(doc->index, doc->indexlen);
+	doc->index = NULL;
+	doc->indexlen = 0;
+}
@@ -0,0 +1,355 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "pagina.h"
+
+/* Number and name trees map keys to values through a tree of dictionaries:
+the leaves hold /Nums or /Names arrays of sorted key-value pairs, and the
+other nodes /Kids, each kid giving the range of its keys in /Limits.
+Lookups go down by binary search on the limits, reading one kid per probe,
+so they touch O(log n) objects. */
+
+#define MAX_TREE_DEPTH 64
+
+struct _key {
+	long num;
+	pag_string *str; /* NULL in number trees */
+};
+
+static pag_object *
+resolve(pag_document *doc, pag_object *obj)
+{
+	pag_ref *ref = pag_obj2ref(obj);
+	if (ref != NULL)
+		return doc != NULL ? pag_get_indirect_obj(doc, *ref) : NULL;
+	return obj;
+}
+
+/* Compare strings as bytes, a prefix coming first. */
+static int
+cmp_strings(pag_string *s, pag_string *t)
+{
+	size_t len = s->len < t->len ? s->len : t->len;
+	int c = len > 0 ? memcmp(s->str, t->str, len) : 0;
+	if (c != 0)
+		return c < 0 ? -1 : 1;
+	return s->len < t->len ? -1 : s->len > t->len;
+}
+
+/* Compare the key in obj with k; *ok is cleared if obj is not a key of
+the right type. */
+static int
+cmp_key(pag_object *obj, struct _key *k, int *ok)
+{
+	if (k->str == NULL) {
+		if (obj == NULL || obj->type != PAG_INT) {
+			*ok = 0;
+			return 0;
+		}
+		long v = obj->val.intv.val;
+		return v < k->num ? -1 : v > k->num;
+	}
+	if (obj == NULL || obj->type != PAG_STRING) {
+		*ok = 0;
+		return 0;
+	}
+	return cmp_strings(&obj->val.str, k->str);
+}
+
+/* Elements of an array, in a new array of n pointers. */
+static pag_object **
+array_elems(pag_array *arr, size_t *n)
+{
+	*n = 0;
+	for (pag_array *a = arr; a != NULL; a = a->next)
+		(*n)++;
+	pag_object **elems = malloc((*n > 0 ? *n : 1) * sizeof(pag_object *));
+	size_t i = 0;
+	for (pag_array *a = arr; a != NULL; a = a->next)
+		elems[i++] = a->val;
+	return elems;
+}
+
+static pag_object *
+tree_get(pag_document *doc, pag_object *tree, struct _key *k, char *leaf,
+		int depth)
+{
+	pag_dict *node = pag_obj2dict(resolve(doc, tree));
+	if (node == NULL || depth > MAX_TREE_DEPTH)
+		return NULL;
+
+	pag_array *pairs = pag_obj2array(resolve(doc,
+		pag_dict_get(node, pag_make_name(leaf))));
+	if (pairs != NULL) {
+		size_t n;
+		pag_object **elems = array_elems(pairs, &n);
+		pag_object *res = NULL;
+		size_t lo = 0, hi = n/2;
+		while (lo < hi) {
+			size_t mid = lo + (hi-lo)/2;
+			int ok = 1;
+			int c = cmp_key(resolve(doc, elems[2*mid]), k, &ok);
+			if (!ok)
+				break;
+			if (c == 0) {
+				res = resolve(doc, elems[2*mid+1]);
+				break;
+			}
+			if (c < 0)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		free(elems);
+		return res;
+	}
+
+	pag_array *kids = pag_obj2array(resolve(doc,
+		pag_dict_get(node, pag_make_name("Kids"))));
+	size_t n;
+	pag_object **elems = array_elems(kids, &n);
+	pag_object *res = NULL;
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		pag_dict *kid = pag_obj2dict(resolve(doc, elems[mid]));
+		pag_array *limits = kid != NULL ? pag_obj2array(resolve(doc,
+			pag_dict_get(kid, pag_make_name("Limits")))) : NULL;
+		int ok = limits != NULL && limits->next != NULL;
+		int below = ok ? cmp_key(resolve(doc, limits->val), k, &ok) : 0;
+		int above = ok ? cmp_key(resolve(doc, limits->next->val), k,
+			&ok) : 0;
+		if (!ok) {
+			/* no usable limits, try the kids in turn */
+			for (size_t i=0; i<n && res == NULL; i++)
+				res = tree_get(doc, elems[i], k, leaf, depth+1);
+			break;
+		}
+		if (below > 0) {
+			hi = mid;
+		} else if (above < 0) {
+			lo = mid+1;
+		} else {
+			res = tree_get(doc, elems[mid], k, leaf, depth+1);
+			break;
+		}
+	}
+	free(elems);
+	return res;
+}
+
+pag_object *
+pag_number_tree_get(pag_document *doc, pag_object *tree, long key)
+{
+	struct _key k = {.num=key};
+	return tree_get(doc, tree, &k, "Nums", 0);
+}
+
+pag_object *
+pag_name_tree_get(pag_document *doc, pag_object *tree, char *key,
+		size_t len)
+{
+	pag_string str = {.len=len, .str=key};
+	struct _key k = {.str=&str};
+	return tree_get(doc, tree, &k, "Names", 0);
+}
+
+static int
+tree_foreach(pag_document *doc, pag_object *tree,
+		int (*fn)(pag_object *, pag_object *, void *), void *arg,
+		int depth)
+{
+	pag_dict *node = pag_obj2dict(resolve(doc, tree));
+	if (node == NULL || depth > MAX_TREE_DEPTH)
+		return 0;
+
+	char *leaves[] = {"Nums", "Names"};
+	for (size_t i=0; i<sizeof(leaves)/sizeof(leaves[0]); i++) {
+		pag_array *a = pag_obj2array(resolve(doc,
+			pag_dict_get(node, pag_make_name(leaves[i]))));
+		for (; a != NULL && a->next != NULL; a = a->next->next) {
+			int ret = fn(resolve(doc, a->val),
+				resolve(doc, a->next->val), arg);
+			if (ret != 0)
+				return ret;
+		}
+	}
+
+	pag_array *kids = pag_obj2array(resolve(doc,
+		pag_dict_get(node, pag_make_name("Kids"))));
+	for (pag_array *a = kids; a != NULL; a = a->next) {
+		int ret = tree_foreach(doc, a->val, fn, arg, depth+1);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+int
+pag_tree_foreach(pag_document *doc, pag_object *tree,
+		int (*fn)(pag_object *key, pag_object *val, void *arg),
+		void *arg)
+{
+	return tree_foreach(doc, tree, fn, arg, 0);
+}
+
+
+/**** writing ****/
+
+/* The leaves get n/leafsize entries or one more, and each level above
+groups up to leafsize nodes, so that all leaves are at the same depth. */
+
+struct _entry {
+	pag_object *key;
+	pag_object *val;
+};
+
+struct _node {
+	pag_dict *dict;
+	pag_object *first; /* smallest and largest keys under it */
+	pag_object *last;
+};
+
+static int
+cmp_num_entries(const void *a, const void *b)
+{
+	long x = ((const struct _entry *)a)->key->val.intv.val;
+	long y = ((const struct _entry *)b)->key->val.intv.val;
+	return x < y ? -1 : x > y;
+}
+
+static int
+cmp_name_entries(const void *a, const void *b)
+{
+	return cmp_strings(&((const struct _entry *)a)->key->val.str,
+		&((const struct _entry *)b)->key->val.str);
+}
+
+static pag_object *
+make_limits(struct _node *node)
+{
+	pag_array *limits = pag_make_array_single(pag_copy_object(node->first));
+	pag_array_append(limits, pag_copy_object(node->last));
+	return pag_array2obj(limits);
+}
+
+/* Make the nodes of a level indirect objects of doc, and set ids[i] to the
+id of node i. */
+static void
+insert_level(pag_document *doc, struct _node *nodes, size_t n,
+		unsigned int *ids)
+{
+	pag_object **objs = malloc((n+1) * sizeof(pag_object *));
+	for (size_t i=0; i<n; i++) {
+		pag_dict_set(nodes[i].dict, pag_make_name("Limits"),
+			make_limits(&nodes[i]));
+		objs[i] = pag_dict2obj(nodes[i].dict);
+	}
+	objs[n] = NULL;
+	int first = pag_insert_objects(objs, doc);
+	for (size_t i=0; i<n; i++)
+		ids[i] = first + i;
+	free(objs);
+}
+
+static pag_object *
+make_tree(pag_document *doc, struct _entry *entries, size_t n,
+		size_t leafsize, char *leaf)
+{
+	if (leafsize < 2)
+		leafsize = 2;
+	size_t len = n > 0 ? (n + leafsize-1) / leafsize : 1;
+	struct _node *nodes = calloc(len, sizeof(struct _node));
+	for (size_t i=0; i<len; i++) {
+		size_t from = i*n/len, to = (i+1)*n/len;
+		pag_array *pairs = NULL;
+		for (size_t j=from; j<to; j++) {
+			pairs = pag_array_append(pairs, entries[j].key);
+			pag_array_append(pairs, entries[j].val);
+		}
+		nodes[i].dict = pag_make_empty_dict();
+		pag_dict_set(nodes[i].dict, pag_make_name(leaf),
+			pag_array2obj(pairs));
+		nodes[i].first = to > from ? entries[from].key : NULL;
+		nodes[i].last = to > from ? entries[to-1].key : NULL;
+	}
+
+	unsigned int *ids = malloc(len * sizeof(unsigned int));
+	while (len > 1) {
+		insert_level(doc, nodes, len, ids);
+		size_t up = (len + leafsize-1) / leafsize;
+		struct _node *parents = calloc(up, sizeof(struct _node));
+		for (size_t i=0; i<up; i++) {
+			size_t from = i*len/up, to = (i+1)*len/up;
+			pag_array *kids = NULL;
+			for (size_t j=from; j<to; j++)
+				kids = pag_array_append(kids, pag_ref2obj(
+					pag_make_ref(ids[j], 0, NULL)));
+			parents[i].dict = pag_make_empty_dict();
+			pag_dict_set(parents[i].dict, pag_make_name("Kids"),
+				pag_array2obj(kids));
+			parents[i].first = nodes[from].first;
+			parents[i].last = nodes[to-1].last;
+		}
+		free(nodes);
+		nodes = parents;
+		len = up;
+	}
+
+	/* the root has no /Limits */
+	pag_object *root = pag_dict2obj(nodes[0].dict);
+	free(nodes);
+	free(ids);
+	return root;
+}
+
+pag_object *
+pag_make_number_tree(pag_document *doc, long *keys, pag_object *vals[],
+		size_t n, size_t leafsize)
+{
+	struct _entry *entries = malloc((n > 0 ? n : 1) * sizeof(*entries));
+	for (size_t i=0; i<n; i++) {
+		entries[i].key = pag_int2obj(pag_make_int(keys[i]));
+		entries[i].val = vals[i];
+	}
+	qsort(entries, n, sizeof(*entries), cmp_num_entries);
+	pag_object *root = make_tree(doc, entries, n, leafsize, "Nums");
+	free(entries);
+	return root;
+}
+
+pag_object *
+pag_make_name_tree(pag_document *doc, pag_string *keys, pag_object *vals[],
+		size_t n, size_t leafsize)
+{
+	struct _entry *entries = malloc((n > 0 ? n : 1) * sizeof(*entries));
+	for (size_t i=0; i<n; i++) {
+		entries[i].key = pag_string2obj(pag_make_string(keys[i].str,
+			keys[i].len));
+		entries[i].val = vals[i];
+	}
+	qsort(entries, n, sizeof(*entries), cmp_name_entries);
+	pag_object *root = make_tree(doc, entries, n, leafsize, "Names");
+	free(entries);
+	return root;
+}
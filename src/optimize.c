@@ -0,0 +1,578 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pagina.h"
+
+struct _buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static void
+buf_put(struct _buf *b, const void *p, size_t n)
+{
+	if (b->len + n > b->cap) {
+		b->cap = 2*(b->len + n);
+		b->data = realloc(b->data, b->cap);
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+/* Apply fn to every reference inside obj, without following them. */
+void
+pag_for_each_ref(pag_object *obj, void (*fn)(pag_ref *, void *), void *arg)
+{
+	if (obj == NULL)
+		return;
+	switch (obj->type) {
+	case PAG_REF:
+		fn(&obj->val.ref, arg);
+		break;
+	case PAG_ARRAY:
+		for (pag_array *a = obj->val.array; a != NULL; a = a->next)
+			pag_for_each_ref(a->val, fn, arg);
+		break;
+	case PAG_STREAM:
+		pag_for_each_ref(pag_dict2obj(obj->val.stream->dict), fn, arg);
+		break;
+	case PAG_DICT: {
+		pag_dict *dict = obj->val.dict;
+		for (int i=0; i < (1<<dict->exp); i++)
+			pag_for_each_ref(dict->ht[i].obj, fn, arg);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+
+/**** stream deduplication ****/
+
+/* MurmurHash3, x64 128-bit variant */
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static void
+murmur3_128(const void *key, size_t len, uint64_t seed, uint64_t out[2])
+{
+	const unsigned char *data = key;
+	size_t nblocks = len / 16;
+	uint64_t h1 = seed, h2 = seed;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+	for (size_t i=0; i<nblocks; i++) {
+		uint64_t k1, k2;
+		memcpy(&k1, data + 16*i, 8);
+		memcpy(&k2, data + 16*i + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+	}
+
+	const unsigned char *tail = data + 16*nblocks;
+	uint64_t k1 = 0, k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+	case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+	case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+	case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+	case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+	case 10: k2 ^= (uint64_t)tail[9] << 8; /* fall through */
+	case 9: k2 ^= (uint64_t)tail[8];
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		/* fall through */
+	case 8: k1 ^= (uint64_t)tail[7] << 56; /* fall through */
+	case 7: k1 ^= (uint64_t)tail[6] << 48; /* fall through */
+	case 6: k1 ^= (uint64_t)tail[5] << 40; /* fall through */
+	case 5: k1 ^= (uint64_t)tail[4] << 32; /* fall through */
+	case 4: k1 ^= (uint64_t)tail[3] << 24; /* fall through */
+	case 3: k1 ^= (uint64_t)tail[2] << 16; /* fall through */
+	case 2: k1 ^= (uint64_t)tail[1] << 8; /* fall through */
+	case 1: k1 ^= (uint64_t)tail[0];
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len; h2 ^= len;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+	out[0] = h1;
+	out[1] = h2;
+}
+
+static int
+cmp_entries(const void *a, const void *b)
+{
+	const struct _ht_entry *x = *(struct _ht_entry * const *)a;
+	const struct _ht_entry *y = *(struct _ht_entry * const *)b;
+	return strcmp(x->key, y->key);
+}
+
+/* Serialize an object unambiguously, with dictionary keys sorted, so that
+equal objects give equal bytes. */
+static void
+canon_obj(struct _buf *b, pag_object *obj)
+{
+	char tag = obj->type;
+	buf_put(b, &tag, 1);
+	switch (obj->type) {
+	case PAG_STRING:
+		buf_put(b, &obj->val.str.len, sizeof(size_t));
+		buf_put(b, obj->val.str.str, obj->val.str.len);
+		break;
+	case PAG_NAME:
+		buf_put(b, obj->val.name.str, strlen(obj->val.name.str)+1);
+		break;
+	case PAG_INT:
+		buf_put(b, &obj->val.intv.val, sizeof(int));
+		break;
+	case PAG_FLOAT:
+		buf_put(b, &obj->val.floatv.val, sizeof(double));
+		break;
+	case PAG_BOOL:
+		buf_put(b, &obj->val.boolv.val, sizeof(int));
+		break;
+	case PAG_NULL:
+		break;
+	case PAG_ARRAY:
+		for (pag_array *a = obj->val.array; a != NULL; a = a->next)
+			canon_obj(b, a->val);
+		buf_put(b, "]", 1);
+		break;
+	case PAG_DICT: {
+		pag_dict *dict = obj->val.dict;
+		struct _ht_entry **entries = malloc(
+			(dict->len+1) * sizeof(struct _ht_entry *));
+		size_t n = 0;
+		for (int i=0; i < (1<<dict->exp); i++)
+			if (dict->ht[i].obj != NULL)
+				entries[n++] = &dict->ht[i];
+		qsort(entries, n, sizeof(entries[0]), cmp_entries);
+		for (size_t i=0; i<n; i++) {
+			buf_put(b, entries[i]->key, strlen(entries[i]->key)+1);
+			canon_obj(b, entries[i]->obj);
+		}
+		buf_put(b, ">", 1);
+		free(entries);
+		break;
+	}
+	case PAG_STREAM:
+		canon_obj(b, pag_dict2obj(obj->val.stream->dict));
+		break;
+	case PAG_REF:
+		buf_put(b, &obj->val.ref.id, sizeof(unsigned int));
+		buf_put(b, &obj->val.ref.gen, sizeof(unsigned int));
+		break;
+	}
+}
+
+struct _dupcand {
+	uint64_t h[2];
+	unsigned int id;
+};
+
+static int
+cmp_cands(const void *a, const void *b)
+{
+	const struct _dupcand *x = a, *y = b;
+	if (x->h[0] != y->h[0])
+		return x->h[0] < y->h[0] ? -1 : 1;
+	if (x->h[1] != y->h[1])
+		return x->h[1] < y->h[1] ? -1 : 1;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+static pag_stream *
+doc_stream(pag_document *doc, unsigned int id)
+{
+	return pag_obj2stream(doc->objs[id-1].obj);
+}
+
+/* Get raw stream data, setting *tmp if the buffer must be freed. */
+static char *
+raw_data(pag_stream *stream, int *tmp)
+{
+	*tmp = stream->stream == NULL;
+	return *tmp ? pag_load_raw_stream(stream) : stream->stream;
+}
+
+static int
+same_stream(pag_stream *a, pag_stream *b)
+{
+	if (a->len != b->len)
+		return 0;
+
+	struct _buf ca = {0}, cb = {0};
+	canon_obj(&ca, pag_dict2obj(a->dict));
+	canon_obj(&cb, pag_dict2obj(b->dict));
+	int same = ca.len == cb.len && !memcmp(ca.data, cb.data, ca.len);
+	free(ca.data);
+	free(cb.data);
+	if (!same)
+		return 0;
+
+	int tmpa, tmpb;
+	char *ra = raw_data(a, &tmpa), *rb = raw_data(b, &tmpb);
+	same = ra != NULL && rb != NULL && !memcmp(ra, rb, a->len);
+	if (tmpa)
+		free(ra);
+	if (tmpb)
+		free(rb);
+	return same;
+}
+
+struct _remap {
+	pag_document *doc;
+	unsigned int *newid; /* 0 for unchanged */
+};
+
+static void
+remap_ref(pag_ref *ref, void *arg)
+{
+	struct _remap *r = arg;
+	if (ref->id < 1 || ref->id > (unsigned)r->doc->len)
+		return;
+	unsigned int id = r->newid[ref->id];
+	if (id != 0) {
+		ref->id = id;
+		ref->gen = r->doc->objs[id-1].gen;
+	}
+}
+
+/* Rewrite the references to the n objects in dups, found through the
+reference index, as given by newid. */
+static void
+remap_document(pag_document *doc, pag_refindex *ri, unsigned int *dups,
+		size_t n, unsigned int *newid)
+{
+	struct _idrow srcs = {0};
+	for (size_t i=0; i<n; i++) {
+		unsigned int *ids;
+		size_t len = pag_refs_to(ri, dups[i], &ids);
+		for (size_t j=0; j<len; j++) {
+			if (srcs.len == srcs.cap) {
+				srcs.cap = srcs.cap ? 2*srcs.cap : 64;
+				srcs.ids = realloc(srcs.ids,
+					srcs.cap * sizeof(unsigned int));
+			}
+			srcs.ids[srcs.len++] = ids[j];
+		}
+	}
+
+	struct _remap r = {.doc=doc, .newid=newid};
+	for (size_t i=0; i<srcs.len; i++) {
+		unsigned int id = srcs.ids[i];
+		if (id == 0 || doc->objs[id-1].obj == NULL)
+			continue;
+		pag_for_each_ref(doc->objs[id-1].obj, remap_ref, &r);
+		pag_mark_dirty(doc, id);
+	}
+	/* the index only follows the last trailer */
+	for (pag_array *t = doc->trailer_dicts; t != NULL; t = t->next)
+		pag_for_each_ref(t->val, remap_ref, &r);
+	free(srcs.ids);
+}
+
+/* Streams are compared by a hash of their dictionary and raw data, and
+candidates with equal hashes are then compared byte for byte. Collapsing
+some streams can make the dictionaries of others equal (e.g. images with
+equal soft masks), so this is repeated until nothing changes. */
+int
+pag_dedup_streams(pag_document *doc)
+{
+	pag_refindex *ri = pag_get_refindex(doc);
+	if (ri == NULL)
+		return -1;
+	int total = 0;
+	uint64_t (*rawh)[2] = calloc(doc->len+1, sizeof(rawh[0]));
+	unsigned int *newid = calloc(doc->len+1, sizeof(unsigned int));
+	unsigned int *dups = malloc((doc->len+1) * sizeof(unsigned int));
+	struct _dupcand *cands = malloc((doc->len+1) * sizeof(struct _dupcand));
+
+	for (int id=1; id<=doc->len; id++) {
+		pag_stream *stream = doc_stream(doc, id);
+		if (stream == NULL)
+			continue;
+		pag_encode_stream(stream);
+		int tmp;
+		char *raw = raw_data(stream, &tmp);
+		if (raw == NULL)
+			continue;
+		murmur3_128(raw, stream->len, 0, rawh[id]);
+		if (tmp)
+			free(raw);
+	}
+
+	for (;;) {
+		size_t n = 0;
+		struct _buf b = {0};
+		for (int id=1; id<=doc->len; id++) {
+			pag_stream *stream = doc_stream(doc, id);
+			if (stream == NULL)
+				continue;
+			b.len = 0;
+			canon_obj(&b, pag_dict2obj(stream->dict));
+			buf_put(&b, rawh[id], sizeof(rawh[id]));
+			murmur3_128(b.data, b.len, 0, cands[n].h);
+			cands[n++].id = id;
+		}
+		free(b.data);
+		qsort(cands, n, sizeof(struct _dupcand), cmp_cands);
+
+		int found = 0;
+		memset(newid, 0, (doc->len+1) * sizeof(unsigned int));
+		for (size_t i=0, first=0; i<n; i++) {
+			if (cands[i].h[0] != cands[first].h[0]
+			    || cands[i].h[1] != cands[first].h[1]) {
+				first = i;
+				continue;
+			}
+			if (i == first)
+				continue;
+
+			unsigned int keep = cands[first].id, dup = cands[i].id;
+			if (!same_stream(doc_stream(doc, keep),
+					doc_stream(doc, dup)))
+				continue;
+			pag_cache_drop(doc->cache, dup);
+			pag_free_object(doc->objs[dup-1].obj);
+			doc->objs[dup-1].obj = NULL;
+			pag_mark_dirty(doc, dup);
+			newid[dup] = keep;
+			dups[found++] = dup;
+		}
+
+		if (found == 0)
+			break;
+		remap_document(doc, ri, dups, found, newid);
+		total += found;
+	}
+
+	free(dups);
+	free(cands);
+	free(newid);
+	free(rawh);
+	return total;
+}
+
+
+/**** garbage collection ****/
+
+/* Objects are marked from the trailer through the reference index. Each
+is pushed once, when it is first marked, so the stack never holds more
+than doc->len ids. */
+int
+pag_collect_garbage(pag_document *doc)
+{
+	pag_refindex *ri = pag_get_refindex(doc);
+	if (ri == NULL)
+		return -1;
+	uint64_t *bits = calloc(doc->len/64 + 1, sizeof(uint64_t));
+	unsigned int *stack = malloc((doc->len+1) * sizeof(unsigned int));
+	size_t len = 0;
+
+	stack[len++] = 0;
+	while (len > 0) {
+		unsigned int *ids;
+		size_t n = pag_refs_from(ri, stack[--len], &ids);
+		for (size_t i=0; i<n; i++) {
+			unsigned int id = ids[i];
+			if (bits[id/64] & (uint64_t)1 << id%64)
+				continue;
+			bits[id/64] |= (uint64_t)1 << id%64;
+			stack[len++] = id;
+		}
+	}
+
+	int freed = 0;
+	for (unsigned int id=1; id <= (unsigned)doc->len; id++) {
+		if (bits[id/64] & (uint64_t)1 << id%64
+		    || doc->objs[id-1].obj == NULL)
+			continue;
+		pag_cache_drop(doc->cache, id);
+		pag_free_object(doc->objs[id-1].obj);
+		doc->objs[id-1].obj = NULL;
+		pag_mark_dirty(doc, id);
+		freed++;
+	}
+
+	free(stack);
+	free(bits);
+	return freed;
+}
+
+
+/**** renumbering ****/
+
+struct _ids {
+	unsigned int *ids;
+	size_t len;
+	size_t cap;
+};
+
+static void
+push_ref(pag_ref *ref, void *arg)
+{
+	struct _ids *s = arg;
+	if (s->len == s->cap) {
+		s->cap = s->cap ? 2*s->cap : 64;
+		s->ids = realloc(s->ids, s->cap * sizeof(unsigned int));
+	}
+	s->ids[s->len++] = ref->id;
+}
+
+/* Rewrite the references in obj. References to objects that do not exist
+become null, as readers would take them. */
+void
+pag_renumber_refs(pag_object *obj, unsigned int *newid, unsigned int len)
+{
+	if (obj == NULL)
+		return;
+	switch (obj->type) {
+	case PAG_REF: {
+		unsigned int id = obj->val.ref.id;
+		if (id >= 1 && id <= len && newid[id] != 0) {
+			obj->val.ref.id = newid[id];
+			obj->val.ref.gen = 0;
+		} else {
+			obj->type = PAG_NULL;
+		}
+		break;
+	}
+	case PAG_ARRAY:
+		for (pag_array *a = obj->val.array; a != NULL; a = a->next)
+			pag_renumber_refs(a->val, newid, len);
+		break;
+	case PAG_STREAM:
+		pag_renumber_refs(pag_dict2obj(obj->val.stream->dict), newid, len);
+		break;
+	case PAG_DICT: {
+		pag_dict *dict = obj->val.dict;
+		for (int i=0; i < (1<<dict->exp); i++)
+			pag_renumber_refs(dict->ht[i].obj, newid, len);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+int
+pag_renumber_objects(pag_document *doc)
+{
+	if (pag_is_encrypted(doc) || pag_load_all(doc) < 0)
+		return -1;
+	unsigned int len = doc->len;
+	unsigned int *newid = calloc(len+1, sizeof(unsigned int));
+	unsigned int n = 0;
+
+	/* depth-first, numbering objects when they are popped; children are
+	pushed in reverse so that the first one is visited first */
+	struct _ids stack = {0}, children = {0};
+	pag_dict *trailer = doc->trailer_dicts->val->val.dict;
+	char *roots[] = {"Encrypt", "Info", "Root"};
+	pag_for_each_ref(doc->trailer_dicts->val, push_ref, &stack);
+	for (size_t i=0; i<sizeof(roots)/sizeof(roots[0]); i++)
+		pag_for_each_ref(pag_dict_get(trailer, pag_make_name(roots[i])),
+			push_ref, &stack);
+	while (stack.len > 0) {
+		unsigned int id = stack.ids[--stack.len];
+		if (id < 1 || id > len || newid[id] != 0
+		    || doc->objs[id-1].obj == NULL)
+			continue;
+		newid[id] = ++n;
+		children.len = 0;
+		pag_for_each_ref(doc->objs[id-1].obj, push_ref, &children);
+		while (children.len > 0)
+			push_ref(&(pag_ref){.id=children.ids[--children.len]},
+				&stack);
+	}
+	free(stack.ids);
+	free(children.ids);
+
+	for (unsigned int id=1; id<=len; id++)
+		if (newid[id] == 0 && doc->objs[id-1].obj != NULL)
+			newid[id] = ++n;
+
+	pag_apply_numbering(doc, newid, n);
+	free(newid);
+	return 0;
+}
+
+/* Move object id to newid[id] for every object, newid[id] being in [1, n],
+and rewrite all references. Ids that receive no object are free. */
+void
+pag_apply_numbering(pag_document *doc, unsigned int *newid, unsigned int n)
+{
+	unsigned int len = doc->len;
+	pag_ref *objs = calloc(n > 0 ? n : 1, sizeof(pag_ref));
+	for (unsigned int id=1; id<=len; id++) {
+		pag_object *obj = doc->objs[id-1].obj;
+		if (obj == NULL || newid[id] == 0)
+			continue;
+		unsigned int i = newid[id];
+		pag_renumber_refs(obj, newid, len);
+		if (obj->type == PAG_STREAM) {
+			pag_cache_drop(doc->cache, id);
+			obj->val.stream->id = i;
+		}
+		pag_set_owner(obj, doc, i);
+		objs[i-1] = pag_make_ref(i, 0, obj);
+	}
+	for (pag_array *t = doc->trailer_dicts; t != NULL; t = t->next)
+		pag_renumber_refs(t->val, newid, len);
+
+	free(doc->objs);
+	doc->objs = objs;
+	doc->len = n;
+	pag_invalidate_pagetree(doc);
+	pag_invalidate_refindex(doc);
+	pag_dict_set(doc->trailer_dicts->val->val.dict, pag_make_name("Size"),
+		pag_int2obj(pag_make_int(n+1)));
+
+	/* every id now names a different object */
+	free(doc->dirty);
+	doc->dirty = malloc(n+1);
+	memset(doc->dirty, 1, n+1);
+}
@@ -0,0 +1,477 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pagina.h"
+
+/* The page tree is walked once into a flat array of pages, each with the
+attributes it inherits from its ancestors. The array is kept on the
+document and updated when pages are inserted or removed through it. */
+
+static char *inherited[] = {"Resources", "MediaBox", "CropBox", "Rotate"};
+#define NB_INHERITED (sizeof(inherited)/sizeof(inherited[0]))
+
+static pag_dict *
+node_dict(pag_document *doc, unsigned int id)
+{
+	return pag_obj2dict(pag_load_object(doc, id));
+}
+
+static unsigned int
+ref_id(pag_object *obj)
+{
+	pag_ref *ref = pag_obj2ref(obj);
+	return ref != NULL ? ref->id : 0;
+}
+
+static void
+set_attrs(pag_page *page, pag_object **attrs)
+{
+	page->resources = attrs[0];
+	page->mediabox = attrs[1];
+	page->cropbox = attrs[2];
+	page->rotate = attrs[3];
+}
+
+static void
+append_page(pag_pagetree *tree, unsigned int id, unsigned int parent,
+		pag_object **attrs, unsigned int *from)
+{
+	if (tree->len == tree->cap) {
+		tree->cap = tree->cap ? 2*tree->cap : 64;
+		tree->pages = realloc(tree->pages,
+			tree->cap * sizeof(pag_page));
+	}
+	pag_page *page = &tree->pages[tree->len++];
+	page->id = id;
+	page->parent = parent;
+	page->dict = node_dict(tree->doc, id);
+	set_attrs(page, attrs);
+	page->unread = 0;
+	memcpy(page->from, from, sizeof(page->from));
+}
+
+/* Read the dictionary and attributes of a page from an index. */
+static void
+read_page(pag_pagetree *tree, pag_page *page)
+{
+	pag_object *attrs[NB_INHERITED] = {0};
+	for (size_t i=0; i<NB_INHERITED; i++) {
+		pag_dict *dict = node_dict(tree->doc, page->from[i]);
+		if (dict != NULL)
+			attrs[i] = pag_dict_get(dict,
+				pag_make_name(inherited[i]));
+	}
+	page->dict = node_dict(tree->doc, page->id);
+	set_attrs(page, attrs);
+	page->unread = 0;
+}
+
+struct _frame {
+	unsigned int id;
+	unsigned int parent;
+	pag_object *attrs[NB_INHERITED];
+	unsigned int from[NB_INHERITED];
+};
+
+static pag_pagetree *
+build_pagetree(pag_document *doc)
+{
+	if (doc->index != NULL) {
+		pag_pagetree *tree = pag_index_pagetree(doc);
+		if (tree != NULL)
+			return tree;
+	}
+
+	pag_ref *rootref = pag_get_root(doc);
+	pag_dict *catalog = rootref != NULL ? node_dict(doc, rootref->id) : NULL;
+	if (catalog == NULL)
+		return NULL;
+	unsigned int root = ref_id(pag_dict_get(catalog,
+		pag_make_name("Pages")));
+	if (node_dict(doc, root) == NULL)
+		return NULL;
+
+	pag_pagetree *tree = calloc(1, sizeof(pag_pagetree));
+	tree->doc = doc;
+	tree->root = root;
+
+	char *seen = calloc(doc->len+1, 1);
+	size_t len = 0, cap = 64;
+	struct _frame *stack = malloc(cap * sizeof(struct _frame));
+	stack[len++] = (struct _frame){.id=root};
+	while (len > 0) {
+		struct _frame f = stack[--len];
+		pag_dict *dict = node_dict(doc, f.id);
+		if (dict == NULL || seen[f.id])
+			continue;
+		seen[f.id] = 1;
+
+		for (size_t i=0; i<NB_INHERITED; i++) {
+			pag_object *obj = pag_dict_get(dict,
+				pag_make_name(inherited[i]));
+			if (obj != NULL) {
+				f.attrs[i] = obj;
+				f.from[i] = f.id;
+			}
+		}
+
+		pag_object *kids = pag_dict_get(dict, pag_make_name("Kids"));
+		if (pag_obj2ref(kids) != NULL)
+			kids = pag_load_object(doc, kids->val.ref.id);
+		if (kids == NULL || kids->type != PAG_ARRAY) {
+			append_page(tree, f.id, f.parent, f.attrs, f.from);
+			continue;
+		}
+
+		/* push the kids in reverse, so that the first comes out
+		first */
+		size_t n = pag_array_len(kids->val.array);
+		while (len + n > cap) {
+			cap *= 2;
+			stack = realloc(stack, cap * sizeof(struct _frame));
+		}
+		size_t i = len + n;
+		for (pag_array *a = kids->val.array; a != NULL; a = a->next) {
+			struct _frame kid = f;
+			kid.id = ref_id(a->val);
+			kid.parent = f.id;
+			stack[--i] = kid;
+		}
+		len += n;
+	}
+
+	free(stack);
+	free(seen);
+	return tree;
+}
+
+/* Whether obj is a page or a page tree node, by its /Type. */
+int
+pag_is_page_node(pag_object *obj)
+{
+	pag_dict *dict = pag_obj2dict(obj);
+	pag_name *type = dict != NULL
+		? pag_obj2name(pag_dict_get(dict, pag_make_name("Type"))) : NULL;
+	return type != NULL && (!strcmp(type->str, "Page")
+		|| !strcmp(type->str, "Pages"));
+}
+
+pag_pagetree *
+pag_get_pagetree(pag_document *doc)
+{
+	if (doc->pagetree == NULL)
+		doc->pagetree = build_pagetree(doc);
+	return doc->pagetree;
+}
+
+pag_pagetree *
+pag_make_pagetree(pag_page *pages[])
+{
+	pag_pagetree *tree = calloc(1, sizeof(pag_pagetree));
+	while (pages[tree->len] != NULL)
+		tree->len++;
+	tree->cap = tree->len > 0 ? tree->len : 1;
+	tree->pages = malloc(tree->cap * sizeof(pag_page));
+	for (size_t i=0; i<tree->len; i++)
+		tree->pages[i] = *pages[i];
+	return tree;
+}
+
+void
+pag_invalidate_pagetree(pag_document *doc)
+{
+	if (doc->pagetree == NULL)
+		return;
+	free(doc->pagetree->pages);
+	free(doc->pagetree);
+	doc->pagetree = NULL;
+}
+
+int
+pag_count_pages(pag_document *doc)
+{
+	pag_ref *rootref = pag_get_root(doc);
+	pag_dict *catalog = rootref != NULL ? node_dict(doc, rootref->id) : NULL;
+	if (catalog == NULL)
+		return -1;
+	pag_dict *root = node_dict(doc, ref_id(pag_dict_get(catalog,
+		pag_make_name("Pages"))));
+	pag_object *count = root != NULL
+		? pag_dict_get(root, pag_make_name("Count")) : NULL;
+	if (count == NULL || count->type != PAG_INT || count->val.intv.val < 0)
+		return -1;
+	return count->val.intv.val;
+}
+
+int
+pag_pagetree_nbpages(pag_pagetree *tree)
+{
+	return tree != NULL ? (int)tree->len : 0;
+}
+
+pag_page *
+pag_pagetree_get_page(pag_pagetree *tree, int index)
+{
+	if (tree == NULL || index < 0 || (size_t)index >= tree->len)
+		return NULL;
+	if (tree->pages[index].unread)
+		read_page(tree, &tree->pages[index]);
+	return &tree->pages[index];
+}
+
+/* The index is flat: its kids are the pages. */
+int
+pag_pagetree_nbkids(pag_pagetree *tree)
+{
+	return pag_pagetree_nbpages(tree);
+}
+
+pag_page *
+pag_pagetree_get_kid(pag_pagetree *tree, int index)
+{
+	return pag_pagetree_get_page(tree, index);
+}
+
+
+/**** editing ****/
+
+/* Get the /Kids array object of a node, marking as modified the object
+that holds it. */
+static pag_object *
+node_kids(pag_document *doc, unsigned int node)
+{
+	pag_object *kids = pag_dict_get(node_dict(doc, node),
+		pag_make_name("Kids"));
+	unsigned int id = node;
+	if (pag_obj2ref(kids) != NULL) {
+		id = kids->val.ref.id;
+		kids = pag_load_object(doc, id);
+	}
+	if (kids == NULL || kids->type != PAG_ARRAY)
+		return NULL;
+	pag_mark_dirty(doc, id);
+	return kids;
+}
+
+/* Add delta to /Count of node and of its ancestors. */
+static void
+update_counts(pag_document *doc, unsigned int node, int delta)
+{
+	for (int depth=0; depth < doc->len; depth++) {
+		pag_dict *dict = node_dict(doc, node);
+		if (dict == NULL)
+			break;
+		pag_object *count = pag_dict_get(dict, pag_make_name("Count"));
+		long n = count != NULL && count->type == PAG_INT
+			? count->val.intv.val : 0;
+		pag_dict_set(dict, pag_make_name("Count"),
+			pag_int2obj(pag_make_int(n + delta)));
+		node = ref_id(pag_dict_get(dict, pag_make_name("Parent")));
+	}
+}
+
+static pag_object *
+make_ref_obj(pag_document *doc, unsigned int id)
+{
+	return pag_ref2obj(pag_make_ref(id, doc->objs[id-1].gen, NULL));
+}
+
+int
+pag_pagetree_insert(pag_pagetree *tree, int index, unsigned int id)
+{
+	pag_document *doc = tree->doc;
+	pag_dict *dict = node_dict(doc, id);
+	if (dict == NULL || index < 0 || (size_t)index > tree->len)
+		return -1;
+
+	/* the page goes next to the one it is inserted before, or after the
+	last one */
+	unsigned int parent = tree->root, next = 0, prev = 0;
+	if ((size_t)index < tree->len) {
+		parent = tree->pages[index].parent;
+		next = tree->pages[index].id;
+	} else if (tree->len > 0) {
+		parent = tree->pages[tree->len-1].parent;
+		prev = tree->pages[tree->len-1].id;
+	}
+	pag_object *kids = node_kids(doc, parent);
+	if (kids == NULL)
+		return -1;
+
+	pag_array *node = pag_make_array_single(make_ref_obj(doc, id));
+	pag_array **link = &kids->val.array;
+	if (next != 0) {
+		while (*link != NULL && ref_id((*link)->val) != next)
+			link = &(*link)->next;
+	} else {
+		while (*link != NULL && ref_id((*link)->val) != prev)
+			link = &(*link)->next;
+		if (*link != NULL)
+			link = &(*link)->next;
+	}
+	node->next = *link;
+	*link = node;
+
+	pag_dict_set(dict, pag_make_name("Parent"), make_ref_obj(doc, parent));
+	update_counts(doc, parent, 1);
+
+	/* resolve the inherited attributes from the new ancestors */
+	pag_object *attrs[NB_INHERITED] = {0};
+	unsigned int from[NB_INHERITED] = {0};
+	unsigned int node_id = id;
+	for (int depth=0; depth < doc->len && node_id != 0; depth++) {
+		pag_dict *d = node_dict(doc, node_id);
+		if (d == NULL)
+			break;
+		for (size_t i=0; i<NB_INHERITED; i++)
+			if (attrs[i] == NULL) {
+				attrs[i] = pag_dict_get(d,
+					pag_make_name(inherited[i]));
+				if (attrs[i] != NULL)
+					from[i] = node_id;
+			}
+		node_id = ref_id(pag_dict_get(d, pag_make_name("Parent")));
+	}
+
+	append_page(tree, id, parent, attrs, from);
+	pag_page page = tree->pages[tree->len-1];
+	memmove(&tree->pages[index+1], &tree->pages[index],
+		(tree->len-1 - index) * sizeof(pag_page));
+	tree->pages[index] = page;
+	return 0;
+}
+
+int
+pag_pagetree_remove(pag_pagetree *tree, int index)
+{
+	pag_document *doc = tree->doc;
+	if (index < 0 || (size_t)index >= tree->len)
+		return -1;
+
+	pag_page *page = &tree->pages[index];
+	pag_object *kids = node_kids(doc, page->parent);
+	if (kids == NULL)
+		return -1;
+	pag_array **link = &kids->val.array;
+	while (*link != NULL && ref_id((*link)->val) != page->id)
+		link = &(*link)->next;
+	if (*link == NULL)
+		return -1;
+	*link = (*link)->next;
+	update_counts(doc, page->parent, -1);
+
+	memmove(&tree->pages[index], &tree->pages[index+1],
+		(tree->len-1 - index) * sizeof(pag_page));
+	tree->len--;
+	return 0;
+}
+
+
+/**** page attributes ****/
+
+/* Only the page dictionaries change, so with pag_write_incremental the
+cost is in the pages touched; content streams are left alone. */
+
+/* Whether all the pages can be edited, checked before any is. */
+static int
+valid_pages(pag_pagetree *tree, int *pages, int n)
+{
+	for (int i=0; i<n; i++) {
+		pag_page *page = pag_pagetree_get_page(tree, pages[i]);
+		if (page == NULL || page->dict == NULL)
+			return 0;
+	}
+	return 1;
+}
+
+int
+pag_rotate_pages(pag_document *doc, int *pages, int n, int angle)
+{
+	pag_pagetree *tree = pag_get_pagetree(doc);
+	if (tree == NULL || angle % 90 != 0 || !valid_pages(tree, pages, n))
+		return -1;
+	char *done = calloc(doc->len+1, 1);
+	for (int i=0; i<n; i++) {
+		pag_page *page = pag_pagetree_get_page(tree, pages[i]);
+		if (page->id <= (unsigned)doc->len) {
+			if (done[page->id])
+				continue;
+			done[page->id] = 1;
+		}
+		long rotate = page->rotate != NULL
+			&& page->rotate->type == PAG_INT
+			? page->rotate->val.intv.val : 0;
+		rotate = ((rotate + angle) % 360 + 360) % 360;
+		page->rotate = pag_int2obj(pag_make_int(rotate));
+		pag_dict_set(page->dict, pag_make_name("Rotate"),
+			page->rotate);
+	}
+	free(done);
+	return 0;
+}
+
+static pag_object *
+make_number(double v)
+{
+	if (v > -1e15 && v < 1e15 && v == (long)v)
+		return pag_int2obj(pag_make_int((long)v));
+	return pag_float2obj(pag_make_float(v));
+}
+
+int
+pag_set_page_box(pag_document *doc, int *pages, int n, char *box,
+		double rect[4])
+{
+	char *boxes[] = {"MediaBox", "CropBox", "BleedBox", "TrimBox",
+		"ArtBox"};
+	size_t b = 0;
+	while (b < sizeof(boxes)/sizeof(boxes[0]) && strcmp(box, boxes[b]))
+		b++;
+	pag_pagetree *tree = pag_get_pagetree(doc);
+	if (tree == NULL || b == sizeof(boxes)/sizeof(boxes[0])
+	    || !valid_pages(tree, pages, n))
+		return -1;
+	for (int j=0; j<4; j++)
+		if (!isfinite(rect[j]))
+			return -1;
+
+	for (int i=0; i<n; i++) {
+		pag_page *page = pag_pagetree_get_page(tree, pages[i]);
+		pag_array *arr = NULL;
+		for (int j=4; j-- > 0; ) {
+			pag_array *node = pag_make_array_single(
+				make_number(rect[j]));
+			node->next = arr;
+			arr = node;
+		}
+		pag_object *obj = pag_array2obj(arr);
+		pag_dict_set(page->dict, pag_make_name(boxes[b]), obj);
+		if (b == 0)
+			page->mediabox = obj;
+		else if (b == 1)
+			page->cropbox = obj;
+	}
+	return 0;
+}
@@ -20,12 +20,407 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.
 */
 
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "pagina.h"
 
+/* Open a document lazily, through its sidecar index if "pagina index" made
+one. */
+static pag_document *
+open_input(char *in, char *mode, FILE **filep)
+{
+	FILE *file = fopen(in, mode);
+	if (file == NULL) {
+		perror(in);
+		return NULL;
+	}
+	char *ipath = malloc(strlen(in) + sizeof(".pagidx"));
+	sprintf(ipath, "%s.pagidx", in);
+	pag_document *doc = access(ipath, F_OK) == 0
+		? pag_open_indexed(file, in) : pag_open_file(file);
+	free(ipath);
+	if (doc == NULL) {
+		fprintf(stderr, "%s: error at %ld: %s\n", in,
+			pag_parser_position(), pag_parser_error());
+		return NULL;
+	}
+	if (filep != NULL)
+		*filep = file;
+	return doc;
+}
+
+/* Make or refresh the sidecar index of each file. */
+static int
+make_index(char *paths[], int n)
+{
+	int ret = 0;
+	for (int k=0; k<n; k++) {
+		FILE *file = fopen(paths[k], "rb");
+		if (file == NULL) {
+			perror(paths[k]);
+			ret = 1;
+			continue;
+		}
+		pag_document *doc = pag_open_indexed(file, paths[k]);
+		if (doc == NULL) {
+			fprintf(stderr, "%s: error at %ld: %s\n", paths[k],
+				pag_parser_position(), pag_parser_error());
+			ret = 1;
+		} else {
+			printf("%s %d\n", paths[k],
+				pag_pagetree_nbpages(pag_get_pagetree(doc)));
+		}
+		pag_free_document(doc);
+		fclose(file);
+	}
+	return ret;
+}
+
+static int
+extract(char *in, char *range, char *out)
+{
+	pag_document *doc = open_input(in, "rb", NULL);
+	if (doc == NULL)
+		return 1;
+
+	int n;
+	int *pages = pag_parse_page_range(range, pag_count_pages(doc), &n);
+	if (pages == NULL) {
+		fprintf(stderr, "invalid page range: %s\n", range);
+		return 1;
+	}
+	pag_document *res = pag_extract_pages(doc, pages, n);
+	free(pages);
+	if (res == NULL) {
+		fprintf(stderr, "%s: cannot extract pages\n", in);
+		return 1;
+	}
+
+	FILE *output = fopen(out, "wb");
+	if (output == NULL) {
+		perror(out);
+		return 1;
+	}
+	int err = pag_write_document(res, output, NULL);
+	if (fclose(output) != 0 || err != 0) {
+		fprintf(stderr, "%s: write error\n", out);
+		return 1;
+	}
+	return 0;
+}
+
+/* args holds pairs of page range and output file */
+static int
+split(char *in, char *args[], int n)
+{
+	pag_document *doc = open_input(in, "rb", NULL);
+	if (doc == NULL)
+		return 1;
+
+	int nbpages = pag_pagetree_nbpages(pag_get_pagetree(doc));
+	int **pages = malloc(n * sizeof(int *));
+	int *npages = malloc(n * sizeof(int));
+	pag_sink **sinks = malloc(n * sizeof(pag_sink *));
+	FILE **outputs = malloc(n * sizeof(FILE *));
+	for (int k=0; k<n; k++) {
+		pages[k] = pag_parse_page_range(args[2*k], nbpages, &npages[k]);
+		if (pages[k] == NULL) {
+			fprintf(stderr, "invalid page range: %s\n", args[2*k]);
+			return 1;
+		}
+		outputs[k] = fopen(args[2*k+1], "wb");
+		if (outputs[k] == NULL) {
+			perror(args[2*k+1]);
+			return 1;
+		}
+		sinks[k] = pag_make_fd_sink(fileno(outputs[k]));
+	}
+
+	int err = pag_split_document(doc, pages, npages, n, sinks, NULL);
+	for (int k=0; k<n; k++) {
+		if (fclose(outputs[k]) != 0)
+			err = -1;
+		pag_free_sink(sinks[k]);
+		free(pages[k]);
+	}
+	free(pages);
+	free(npages);
+	free(sinks);
+	free(outputs);
+	if (err != 0) {
+		fprintf(stderr, "split failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Apply a page attribute edit as an incremental update, appended to in,
+or to a copy of it at out if out is not NULL. */
+static int
+edit(char *in, char *range, char *out, int (*fn)(pag_document *, int *, int,
+		void *), void *arg)
+{
+	FILE *file;
+	pag_document *doc = open_input(in, out != NULL ? "rb" : "r+b", &file);
+	if (doc == NULL)
+		return 1;
+
+	int n;
+	int *pages = pag_parse_page_range(range,
+		pag_pagetree_nbpages(pag_get_pagetree(doc)), &n);
+	if (pages == NULL) {
+		fprintf(stderr, "invalid page range: %s\n", range);
+		return 1;
+	}
+	if (fn(doc, pages, n, arg) != 0) {
+		fprintf(stderr, "%s: cannot edit pages\n", in);
+		return 1;
+	}
+	free(pages);
+
+	FILE *output = out != NULL ? fopen(out, "wb") : file;
+	if (output == NULL) {
+		perror(out);
+		return 1;
+	}
+	int err = pag_write_incremental(doc, output, NULL);
+	if (fclose(output) != 0 || err != 0) {
+		fprintf(stderr, "%s: write error\n", out != NULL ? out : in);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+rotate(pag_document *doc, int *pages, int n, void *arg)
+{
+	return pag_rotate_pages(doc, pages, n, *(int *)arg);
+}
+
+static int
+set_box(pag_document *doc, int *pages, int n, void *arg)
+{
+	char **args = arg;
+	double rect[4];
+	for (int i=0; i<4; i++) {
+		char *end;
+		rect[i] = strtod(args[i+1], &end);
+		if (*end != '\0' || end == args[i+1] || !isfinite(rect[i]))
+			return -1;
+	}
+	return pag_set_page_box(doc, pages, n, args[0], rect);
+}
+
+/* Print the label of every page, or the page number of each label. */
+static int
+labels(char *in, char *args[], int n)
+{
+	pag_document *doc = open_input(in, "rb", NULL);
+	if (doc == NULL)
+		return 1;
+
+	pag_pagelabels *pl = pag_get_pagelabels(doc);
+	int ret = 0;
+	if (n == 0) {
+		int nbpages = pag_count_pages(doc);
+		size_t size = 64;
+		char *buf = malloc(size);
+		for (int i=0; i<nbpages; i++) {
+			size_t len = pag_page_label(pl, i, buf, size);
+			if (len >= size) {
+				size = len+1;
+				buf = realloc(buf, size);
+				pag_page_label(pl, i, buf, size);
+			}
+			printf("%d %s\n", i+1, buf);
+		}
+		free(buf);
+	}
+	for (int k=0; k<n; k++) {
+		int index = pag_find_page_label(pl, args[k]);
+		if (index < 0 || index >= pag_count_pages(doc)) {
+			fprintf(stderr, "no page labeled %s\n", args[k]);
+			ret = 1;
+			continue;
+		}
+		printf("%s %d\n", args[k], index+1);
+	}
+	pag_free_pagelabels(pl);
+	return ret;
+}
+
+static void
+put_utf8(unsigned long c)
+{
+	if (c < 0x80) {
+		putchar(c < 0x20 ? ' ' : (int)c);
+	} else if (c < 0x800) {
+		putchar(0xc0 | c>>6);
+		putchar(0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		putchar(0xe0 | c>>12);
+		putchar(0x80 | (c>>6 & 0x3f));
+		putchar(0x80 | (c & 0x3f));
+	} else {
+		putchar(0xf0 | c>>18);
+		putchar(0x80 | (c>>12 & 0x3f));
+		putchar(0x80 | (c>>6 & 0x3f));
+		putchar(0x80 | (c & 0x3f));
+	}
+}
+
+/* Print a text string, in UTF-16BE if it starts with a byte order mark. */
+static void
+print_text(pag_string *str)
+{
+	unsigned char *s = (unsigned char *)str->str;
+	if (str->len < 2 || s[0] != 0xfe || s[1] != 0xff) {
+		for (size_t i=0; i<str->len; i++)
+			putchar(s[i] < 0x20 ? ' ' : s[i]);
+		return;
+	}
+	for (size_t i=2; i+1 < str->len; i += 2) {
+		unsigned long c = s[i]<<8 | s[i+1];
+		if (c >= 0xd800 && c < 0xdc00 && i+3 < str->len) {
+			unsigned long lo = s[i+2]<<8 | s[i+3];
+			if (lo >= 0xdc00 && lo < 0xe000) {
+				c = 0x10000 + ((c-0xd800)<<10) + (lo-0xdc00);
+				i += 2;
+			}
+		}
+		put_utf8(c);
+	}
+}
+
+/* Print what pag_open_info reads of each file. */
+static int
+info(char *paths[], int n)
+{
+	int ret = 0;
+	for (int k=0; k<n; k++) {
+		FILE *file = fopen(paths[k], "rb");
+		if (file == NULL) {
+			perror(paths[k]);
+			ret = 1;
+			continue;
+		}
+		pag_info *info = pag_open_info(file);
+		fclose(file);
+		if (info == NULL) {
+			fprintf(stderr, "%s: error at %ld: %s\n", paths[k],
+				pag_parser_position(), pag_parser_error());
+			ret = 1;
+			continue;
+		}
+		printf("%s\n\tVersion: %d.%d\n\tPages: %d\n\tEncrypted: %s\n",
+			paths[k], info->version/10, info->version%10,
+			info->nbpages, info->encrypted ? "yes" : "no");
+		pag_dict *dict = info->info;
+		for (int i=0; dict != NULL && i < (1<<dict->exp); i++) {
+			pag_object *val = dict->ht[i].obj;
+			if (val == NULL)
+				continue;
+			printf("\t%s: ", dict->ht[i].key);
+			if (val->type == PAG_STRING) {
+				print_text(&val->val.str);
+			} else {
+				char *str = pag_obj2cstring(val);
+				fputs(str != NULL ? str : "?", stdout);
+				free(str);
+			}
+			putchar('\n');
+		}
+		pag_free_info(info);
+	}
+	return ret;
+}
+
+static int
+merge(char *paths[], int n)
+{
+	pag_sink *sink = pag_make_fd_sink(1);
+	int err = pag_merge_files(paths, n, sink, NULL);
+	pag_free_sink(sink);
+	if (err != 0) {
+		fprintf(stderr, "merge failed\n");
+		return 1;
+	}
+	return 0;
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
+	if (argc > 1 && !strcmp(argv[1], "extract")) {
+		if (argc != 5) {
+			fprintf(stderr, "usage: pagina extract in.pdf range "
+				"out.pdf\n");
+			return 2;
+		}
+		return extract(argv[2], argv[3], argv[4]);
+	}
+	if (argc > 1 && !strcmp(argv[1], "split")) {
+		if (argc < 5 || argc % 2 == 0) {
+			fprintf(stderr, "usage: pagina split in.pdf range out.pdf "
+				"[range out.pdf ...]\n");
+			return 2;
+		}
+		return split(argv[2], argv+3, (argc-3)/2);
+	}
+	if (argc > 1 && !strcmp(argv[1], "rotate")) {
+		if (argc != 5 && argc != 6) {
+			fprintf(stderr, "usage: pagina rotate file.pdf range "
+				"angle [out.pdf]\n");
+			return 2;
+		}
+		int angle = atoi(argv[4]);
+		return edit(argv[2], argv[3], argc == 6 ? argv[5] : NULL,
+			rotate, &angle);
+	}
+	if (argc > 1 && !strcmp(argv[1], "box")) {
+		if (argc != 9 && argc != 10) {
+			fprintf(stderr, "usage: pagina box file.pdf range "
+				"MediaBox|CropBox|... llx lly urx ury "
+				"[out.pdf]\n");
+			return 2;
+		}
+		return edit(argv[2], argv[3], argc == 10 ? argv[9] : NULL,
+			set_box, argv+4);
+	}
+	if (argc > 1 && !strcmp(argv[1], "labels")) {
+		if (argc < 3) {
+			fprintf(stderr, "usage: pagina labels in.pdf "
+				"[label ...]\n");
+			return 2;
+		}
+		return labels(argv[2], argv+3, argc-3);
+	}
+	if (argc > 1 && !strcmp(argv[1], "index")) {
+		if (argc < 3) {
+			fprintf(stderr, "usage: pagina index in.pdf ...\n");
+			return 2;
+		}
+		return make_index(argv+2, argc-2);
+	}
+	if (argc > 1 && !strcmp(argv[1], "info")) {
+		if (argc < 3) {
+			fprintf(stderr, "usage: pagina info in.pdf ...\n");
+			return 2;
+		}
+		return info(argv+2, argc-2);
+	}
+	if (argc > 1 && !strcmp(argv[1], "merge")) {
+		if (argc < 3) {
+			fprintf(stderr, "usage: pagina merge in.pdf ... "
+				"> out.pdf\n");
+			return 2;
+		}
+		return merge(argv+2, argc-2);
+	}
+
 	FILE *file = fopen("testfile", "rb");
 	FILE *output = fopen("testout", "wb");
 
@@ -39,4 +434,4 @@ main(void)
 		pag_repl(doc, output);
 
 	return 0;
-}
\ No newline at end of file
+}
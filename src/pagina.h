@@ -51,6 +51,12 @@ typedef struct pag_trailer	pag_trailer;
 typedef struct pag_xref_entry	pag_xref_entry;
 typedef struct pag_xref_table	pag_xref_table;
 typedef struct pag_document	pag_document;
+typedef struct pag_stream_cache	pag_stream_cache;
+typedef struct pag_write_options	pag_write_options;
+typedef struct pag_sink		pag_sink;
+typedef struct pag_pagelabels	pag_pagelabels;
+typedef struct pag_info		pag_info;
+typedef struct pag_refindex	pag_refindex;
 
 
 /**** object types: methods ****/
@@ -101,8 +107,23 @@ pag_stmtype	pag_stream_get_type(pag_stream *stream);
 /* Get stream dictionary. */
 pag_dict	*pag_stream_get_dict(pag_stream *stream);
 
-/* Read stream, applying necessary filters. */
-char		*pag_read_stream(pag_stream *stream);
+/* Read stream, applying necessary filters. The result is a copy that the
+caller must free. */
+char		*pag_read_stream(pag_stream *stream, size_t *len);
+
+/* Same as pag_read_stream, but return a view into the decoded-stream cache,
+which stays valid until the next read of a stream of the same document.
+A stream that is not part of a document keeps the view itself, until it
+is read again. */
+char		*pag_borrow_stream(pag_stream *stream, size_t *len);
+
+/* Read raw (still encoded) stream data, loading it from the input file if
+needed. */
+char		*pag_read_raw_stream(pag_stream *stream);
+
+/* Replace the decoded data of a stream, taking ownership of buf. The stream
+is only encoded again when it is written. */
+void		pag_stream_set_data(pag_stream *stream, char *buf, size_t len);
 
 /* Number of objects in an object stream. */
 int		pag_objstm_nbobjs(pag_stream *stream);
@@ -125,8 +146,9 @@ int		pag_expand_objstm(pag_document *doc, pag_ref reference);
 /* Expand all object streams in a document. */
 int		pag_expand_all_objstm(pag_document *doc);
 
-/* Make an object stream out of an array of references. */
-pag_stream	*pag_make_objstm(pag_array references);
+/* Make a Flate-compressed object stream out of an array of references to
+non-stream objects with generation 0. */
+pag_stream	*pag_make_objstm(pag_array *references);
 
 /* Contract n objects into an object stream. */
 int		pag_contract_objstm(pag_document *doc, pag_ref first, int n);
@@ -148,6 +170,14 @@ pag_object	*pag_cond_deref(pag_object *obj);
 int		pag_relabel_ref(pag_ref ref, unsigned int id,
 				unsigned int gen);
 
+/* Make a deep copy of an object, not part of any document. References are
+copied as they are. */
+pag_object	*pag_copy_object(pag_object *obj);
+
+/* Free an object and everything it contains. References are not
+followed. */
+void		pag_free_object(pag_object *obj);
+
 pag_string	*pag_obj2string(pag_object *obj);
 pag_object	*pag_string2obj(pag_string str);
 pag_name	*pag_obj2name(pag_object *obj);
@@ -172,17 +202,138 @@ int		pag_pagetree_nbkids(pag_pagetree *tree);
 int		pag_pagetree_nbpages(pag_pagetree *tree);
 pag_page	*pag_pagetree_get_kid(pag_pagetree *tree, int index);
 pag_page	*pag_pagetree_get_page(pag_pagetree *tree, int index);
+
+/* Get the flat page index of the document, built on first use. NULL if the
+document has no page tree. */
 pag_pagetree	*pag_get_pagetree(pag_document *doc);
+
+/* Drop the page index, after editing the page tree by hand. */
+void		pag_invalidate_pagetree(pag_document *doc);
+
+/* Insert page object id before the page at index (or after the last page),
+under the same parent node. The index and the /Count of the ancestors are
+updated. */
+int		pag_pagetree_insert(pag_pagetree *tree, int index,
+			unsigned int id);
+
+/* Remove the page at index from the page tree. The page object stays. */
+int		pag_pagetree_remove(pag_pagetree *tree, int index);
+
+/* Rotate pages (0-based indices) by a multiple of 90 degrees, clockwise,
+from their current, possibly inherited, rotation. A page listed more than
+once is rotated once. Nothing is changed if an index is out of range. */
+int		pag_rotate_pages(pag_document *doc, int *pages, int n,
+			int angle);
+
+/* Set a page boundary ("MediaBox", "CropBox", "BleedBox", "TrimBox" or
+"ArtBox") of pages to rect, given as llx lly urx ury. Nothing is changed
+if an index is out of range or a coordinate is not finite. */
+int		pag_set_page_box(pag_document *doc, int *pages, int n,
+			char *box, double rect[4]);
+
+/* Make a flat page index from a NULL-terminated array of pages, for a page
+tree being built. The pages are copied. */
 pag_pagetree	*pag_make_pagetree(pag_page *pages[]);
+
+/* Get the number of pages from the /Count of the page tree root, without
+walking the tree. -1 if the document has no page tree. */
+int		pag_count_pages(pag_document *doc);
+
+/* Parse a page range like "1-3,7,10-" against a document of nbpages pages.
+Pages are numbered from 1; the result holds 0-based indices in the order
+given, and its length is stored in len. NULL if the range is invalid. */
+int		*pag_parse_page_range(char *spec, int nbpages, int *len);
+
+/* Copy pages (0-based indices) of doc and the objects they use into a new
+document with a flat page tree. Only the objects needed are read, so doc
+can come from pag_open_file. Stream data stays in the input file of doc. */
+pag_document	*pag_extract_pages(pag_document *doc, int *pages, int n);
 pag_ref		*pag_get_root(pag_document *doc);
 pag_ref		*pag_get_info(pag_document *doc);
 pag_object	*pag_make_info_dict(void);
+
+/* Get the object of a reference, reading it first if the document was
+opened with pag_open_file. */
 pag_object	*pag_get_indirect_obj(pag_document *doc, pag_ref ref);
 void		pag_set_object(pag_document *doc, pag_ref ref);
+
+/* Free a document and all its objects. The input file is not closed. */
+void		pag_free_document(pag_document *doc);
+
+/* Mark an indirect object as modified, for pag_write_incremental. This is
+done by pag_set_object and by pag_dict_set on dictionaries of the
+document. Id 0, the trailer, only matters to the reference index. */
+void		pag_mark_dirty(pag_document *doc, unsigned int id);
 pag_object	*pag_make_pagelabels(char *spec);
+
+/* Compile a /PageLabels number tree, like the one pag_make_pagelabels
+makes, into a table for looking labels up. References in it are resolved
+in doc, which may be NULL. nbpages bounds the last range, -1 for none. */
+pag_pagelabels	*pag_compile_pagelabels(pag_object *labels, pag_document *doc,
+			int nbpages);
+
+/* Compile the page labels of the document, NULL if it has none. */
+pag_pagelabels	*pag_get_pagelabels(pag_document *doc);
+void		pag_free_pagelabels(pag_pagelabels *pl);
+
+/* Write the label of page index (0-based) to buf, like snprintf. Pages
+without labels are numbered in decimal, as is every page if pl is NULL. */
+size_t		pag_page_label(pag_pagelabels *pl, int index, char *buf,
+			size_t size);
+
+/* Get the index of the page with the given label, -1 if none has it. */
+int		pag_find_page_label(pag_pagelabels *pl, char *label);
+
+/* Make a /PageLabels number tree of a compiled table, see
+pag_make_number_tree. */
+pag_object	*pag_pagelabels_tree(pag_document *doc, pag_pagelabels *pl,
+			size_t leafsize);
+
+/* Look a key up in a number or name tree, NULL if it is not there. Only the
+nodes on the way to the key are read. */
+pag_object	*pag_number_tree_get(pag_document *doc, pag_object *tree,
+			long key);
+pag_object	*pag_name_tree_get(pag_document *doc, pag_object *tree,
+			char *key, size_t len);
+
+/* Call fn on the entries of a number or name tree in order, with
+references resolved, until it returns non-zero; that value is returned. */
+int		pag_tree_foreach(pag_document *doc, pag_object *tree,
+			int (*fn)(pag_object *key, pag_object *val, void *arg),
+			void *arg);
+
+/* Make a balanced number or name tree of n entries, in any order. Leaves
+hold up to leafsize entries and the other nodes up to leafsize kids; they
+are added to doc as new objects, and the root is returned. */
+pag_object	*pag_make_number_tree(pag_document *doc, long *keys,
+			pag_object *vals[], size_t n, size_t leafsize);
+pag_object	*pag_make_name_tree(pag_document *doc, pag_string *keys,
+			pag_object *vals[], size_t n, size_t leafsize);
+
+/* Get the reference index of the document, built on first use from all its
+objects, and kept up to date as they change. */
+pag_refindex	*pag_get_refindex(pag_document *doc);
+
+/* Get the ids of the objects that object id refers to, or that refer to
+it, in increasing order; id 0 is the trailer. The result belongs to the
+index, and lasts until its next use. */
+size_t		pag_refs_from(pag_refindex *ri, unsigned int id,
+			unsigned int **ids);
+size_t		pag_refs_to(pag_refindex *ri, unsigned int id,
+			unsigned int **ids);
+
+/* Add the NULL-terminated objs to doc as new indirect objects, return the
+id of the first one or -1. */
 int		pag_insert_objects(pag_object *objs[], pag_document *doc);
 pag_document	*pag_make_document(pag_pdf_version version, pag_object *objs[]);
 
+/* Set the memory budget of the document's decoded-stream cache. */
+void		pag_set_stream_cache_budget(pag_document *doc, size_t budget);
+
+/* Get the hit and miss counts of the document's decoded-stream cache. */
+void		pag_stream_cache_stats(pag_document *doc, unsigned long *hits,
+			unsigned long *misses);
+
 
 /**** parsing routines ****/
 /* parse one object and advance the file position indicator. */
@@ -191,15 +342,101 @@ pag_object	*pag_parse(FILE *input);
 /* parse the contents of an object stream and return array of objects. */
 pag_array	*pag_parse_objstm(pag_stream *stream);
 
-/* parse whole file, return NULL if it is invalid */
+/* parse whole file, return NULL if it is invalid. Stream data is left in the
+file, which must stay open while the document is in use. */
 pag_document	*pag_parse_file(FILE *input);
 
+/* Like pag_parse_file, but only read the header, the trailers and the
+cross-reference tables. Objects are read when first asked for through
+pag_get_indirect_obj, and all at once by the routines that work on the
+whole document. */
+pag_document	*pag_open_file(FILE *input);
+
+/* Like pag_open_file for the file at path, open as input, but keep what
+opening reads, and the page list, in a sidecar index at path with ".pagidx"
+appended. As long as the file is unchanged, later opens map the index
+instead of reading the cross-reference sections and the page tree. */
+pag_document	*pag_open_indexed(FILE *input, char *path);
+
+/* Read the version, page count, document information and whether the file
+is encrypted, reading only its end and the catalog, page tree root and
+information objects. NULL if the file is invalid. The strings of encrypted
+files are left encrypted. */
+pag_info	*pag_open_info(FILE *input);
+void		pag_free_info(pag_info *info);
+
+/* position and message of the last parse error in the calling thread */
 long		pag_parser_position(void);
 char		*pag_parser_error(void);
 
 /**** writing routines ****/
+/* Serialize an object, without layout whitespace. The caller frees the
+result. Return NULL if it holds a NaN or infinite real. */
 char		*pag_obj2cstring(pag_object *obj);
-int		pag_write_document(pag_document *doc, FILE *output);
+
+/* Sinks receive the output of the writer: a growable memory buffer, a file
+descriptor, or a callback given the output in chunks, which returns nonzero
+on error. */
+pag_sink	*pag_make_memory_sink(void);
+pag_sink	*pag_make_fd_sink(int fd);
+pag_sink	*pag_make_callback_sink(
+			int (*fn)(void *arg, const char *buf, size_t len),
+			void *arg);
+
+/* Get the contents of a memory sink. They belong to the sink. */
+char		*pag_sink_data(pag_sink *sink, size_t *len);
+void		pag_free_sink(pag_sink *sink);
+
+/* Default writing options. */
+pag_write_options	pag_make_write_options(void);
+
+/* Write document. opts may be NULL to use the defaults. */
+int		pag_write_document(pag_document *doc, FILE *output,
+				pag_write_options *opts);
+int		pag_write_to_sink(pag_document *doc, pag_sink *sink,
+				pag_write_options *opts);
+
+/* Merge the files at paths, in order, into one document written to sink.
+Inputs are read a few at a time, in parallel with opts->threads threads,
+and written out as soon as they are read; all are first checked to open
+with a page tree and without encryption, so that nothing is written if one
+cannot be merged. Only opts->threads and opts->compact apply. */
+int		pag_merge_files(char *paths[], int n, pag_sink *sink,
+				pag_write_options *opts);
+
+/* Write pages of doc to several sinks in one pass: sinks[k] gets the
+npages[k] pages (0-based indices) of pages[k]. Objects keep their ids, so
+that those used by several outputs are serialized once; references to
+objects an output does not hold read as null. Outputs are written in
+parallel with opts->threads threads; only that and opts->compact apply. */
+int		pag_split_document(pag_document *doc, int *pages[],
+				int npages[], int n, pag_sink *sinks[],
+				pag_write_options *opts);
+
+/* Write the original file followed by an incremental update holding only
+the modified objects. If output is the input file itself, the update is
+just appended to it. */
+int		pag_write_incremental(pag_document *doc, FILE *output,
+				pag_write_options *opts);
+
+/* Compress uncompressed and weakly compressed streams with the Flate filter,
+using the given number of threads (0 for all cores). */
+int		pag_compress_streams(pag_document *doc, int level, int threads);
+
+/* Collapse identical streams into one object and rewrite references to
+them. Return the number of streams removed. */
+int		pag_dedup_streams(pag_document *doc);
+
+/* Free the objects that cannot be reached from the trailer. Return the
+number of objects freed. */
+int		pag_collect_garbage(pag_document *doc);
+
+/* Give the objects dense ids in the order a depth-first walk from the
+trailer reaches them, so that each page is followed by its resources.
+Unreachable objects come last, free slots disappear. Encrypted documents
+are left as they are and -1 returned, as their ids are part of the
+encryption keys. */
+int		pag_renumber_objects(pag_document *doc);
 
 /**** document structure visualization routines ****/
 char		*pag_view_document(pag_document *doc, unsigned int level);
@@ -247,6 +484,8 @@ struct pag_array
 {
 	pag_object *val;
 	pag_array *next;
+	pag_document *doc; /* document of the indirect object it belongs to */
+	unsigned int id; /* id of that indirect object */
 };
 
 struct _ht_entry
@@ -260,13 +499,26 @@ struct pag_dict
 	size_t len;
 	int exp;
 	struct _ht_entry *ht;
+	pag_document *doc; /* document of the indirect object it belongs to */
+	unsigned int id; /* id of that indirect object */
 };
 
+/* A stream holds its raw, encoded data, which stays in the input file until
+needed. Decoded data lives in the document's decoded-stream cache, except
+after pag_stream_set_data: the new data is then kept in the stream until it
+is encoded on write. */
 struct pag_stream
 {
 	pag_dict *dict;
 	unsigned long len;
-	char *stream;
+	char *stream; /* NULL while the data is only in the input file */
+	int fd; /* input file, -1 if the stream was not parsed from a file */
+	long offset; /* position of the data in the input file */
+	unsigned int id; /* object id, for the decoded-stream cache */
+	pag_stream_cache *cache; /* NULL if not part of a document */
+	char *decoded; /* modified data, NULL if the raw data is up to date */
+	size_t decoded_len;
+	char *view; /* last decoded data borrowed, when there is no cache */
 };
 
 /* reference system: implementation */
@@ -308,6 +560,67 @@ struct pag_object
 	} val;
 };
 
+struct pag_page
+{
+	unsigned int id; /* page object */
+	unsigned int parent; /* page tree node holding it */
+	pag_dict *dict;
+	/* own or inherited attributes, NULL if absent */
+	pag_object *resources;
+	pag_object *mediabox;
+	pag_object *cropbox;
+	pag_object *rotate;
+	/* nodes the attributes above come from, 0 for none. Pages listed
+	in an index are unread: their dictionary and attributes are read
+	from these when first asked for. */
+	unsigned int from[4];
+	int unread;
+};
+
+struct pag_pagetree
+{
+	pag_document *doc;
+	unsigned int root; /* root /Pages node */
+	size_t len;
+	size_t cap;
+	pag_page *pages;
+};
+
+struct _idrow {
+	unsigned int *ids;
+	size_t len;
+	size_t cap;
+};
+
+struct _changed_row {
+	unsigned int id;
+	int valid; /* whether row is up to date */
+	struct _idrow row;
+};
+
+struct pag_refindex
+{
+	pag_document *doc;
+	unsigned int len; /* objects covered by the stored rows */
+	unsigned int *outstart, *out;
+	unsigned int *instart, *in;
+	unsigned int *slot; /* by id, 1 + position in changed, 0 if none */
+	unsigned int nslots;
+	struct _changed_row *changed;
+	size_t nchanged;
+	size_t changedcap;
+	size_t ninvalid; /* changed rows not up to date */
+	struct _idrow res; /* result of the last lookup */
+};
+
+struct pag_info
+{
+	int version; /* 10*major + minor, the later of header and catalog */
+	int nbpages; /* -1 if unknown */
+	int encrypted;
+	pag_dict *info; /* NULL if none */
+};
+
 struct pag_xref_entry {
 	int id;
 	int gen;
@@ -328,4 +641,118 @@ struct pag_document
 	pag_ref *objs;
 	pag_array *trailer_dicts;
 	pag_xref_table table;
-};
\ No newline at end of file
+	pag_stream_cache *cache;
+	int fd; /* input file */
+	long startxref; /* position of the last xref section in it */
+	char *dirty; /* dirty[id] if object id was modified */
+	pag_pagetree *pagetree; /* page index, NULL until needed */
+	FILE *input; /* set while some objects are not read yet */
+	char *index; /* mapped sidecar index, see pag_open_indexed */
+	size_t indexlen;
+	pag_refindex *refindex; /* NULL until needed */
+};
+
+struct _cache_entry
+{
+	unsigned int id;
+	char *data;
+	size_t len;
+	struct _cache_entry *prev, *next; /* LRU list, most recent first */
+	struct _cache_entry *chain; /* hash table bucket */
+};
+
+struct pag_stream_cache
+{
+	size_t budget;
+	size_t used;
+	unsigned long hits;
+	unsigned long misses;
+	struct _cache_entry *first, *last;
+	struct _cache_entry **buckets;
+	size_t nbuckets;
+	size_t len;
+	char *scratch; /* last decoded stream that did not fit in the budget */
+};
+
+struct _label_range
+{
+	long index; /* first page */
+	char style; /* 'D', 'R', 'r', 'A', 'a', or 0 for the prefix only */
+	char *prefix;
+	size_t prefixlen;
+	long start;
+	int next; /* next range with a prefix of the same hash, -1 if none */
+};
+
+struct pag_pagelabels
+{
+	long nbpages; /* -1 if unknown */
+	size_t len;
+	size_t cap;
+	struct _label_range *ranges; /* by first page */
+	int *buckets; /* first range of each prefix hash */
+	size_t nbuckets;
+};
+
+struct pag_sink
+{
+	int fd; /* -1 if not a file */
+	int (*fn)(void *arg, const char *buf, size_t len);
+	void *arg;
+	char *buf; /* memory sink contents */
+	size_t len;
+	size_t cap;
+};
+
+struct pag_write_options
+{
+	int compress; /* Flate level for pag_compress_streams, 0 for none */
+	int threads; /* 0 to use all cores */
+	int dedup; /* run pag_dedup_streams first */
+	int gc; /* run pag_collect_garbage first, which frees the
+			unreachable objects of the document */
+	int renumber; /* run pag_renumber_objects before writing, unless
+			encrypted */
+	int compact; /* minimal whitespace instead of the indented layout */
+	int objstm; /* objects per object stream (PDF 1.5), 0 for none;
+			none for encrypted documents */
+	int linearize; /* first page first, with hint tables; no objstm */
+};
+
+
+/* internal routines */
+void	pag_set_owner(pag_object *obj, pag_document *doc, unsigned int id);
+int	pag_is_encrypted(pag_document *doc);
+void	pag_for_each_ref(pag_object *obj, void (*fn)(pag_ref *, void *),
+		void *arg);
+void	pag_renumber_refs(pag_object *obj, unsigned int *newid,
+		unsigned int len);
+pag_object	*pag_load_object(pag_document *doc, unsigned int id);
+int	pag_is_page_node(pag_object *obj);
+pag_pagetree	*pag_index_pagetree(pag_document *doc);
+int	pag_in_index(pag_document *doc, void *p);
+void	pag_unmap_index(pag_document *doc);
+void	pag_refindex_touch(pag_refindex *ri, unsigned int id);
+void	pag_invalidate_refindex(pag_document *doc);
+int	pag_load_all(pag_document *doc);
+void	pag_apply_numbering(pag_document *doc, unsigned int *newid,
+		unsigned int n);
+char	*pag_load_raw_stream(pag_stream *stream);
+pag_stream_cache	*pag_make_stream_cache(void);
+void	pag_free_stream_cache(pag_stream_cache *cache);
+char	*pag_cache_get(pag_stream_cache *cache, unsigned int id, size_t *len);
+char	*pag_cache_put(pag_stream_cache *cache, unsigned int id,
+			char *data, size_t len);
+void	pag_cache_drop(pag_stream_cache *cache, unsigned int id);
+char	*pag_flate_decode(char *buf, size_t len, size_t *outlen);
+char	*pag_flate_encode(char *buf, size_t len, int level, size_t *outlen);
+int	pag_encode_stream(pag_stream *stream);
+
+/* large enough for any double, 1e308 and 5e-324 included */
+#define PAG_REAL_BUFSIZE 400
+int	pag_format_real(double v, char *out);
+
+/* Call fn(arg, i) for i in [0, n) on up to threads threads. */
+void	pag_parallel_for(int threads, size_t n,
+			void (*fn)(void *, size_t), void *arg);
+int	pag_nb_threads(int threads);
\ No newline at end of file
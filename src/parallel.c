@@ -0,0 +1,85 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pagina.h"
+
+struct _pfor {
+	pthread_mutex_t lock;
+	size_t next;
+	size_t n;
+	void (*fn)(void *, size_t);
+	void *arg;
+};
+
+static void *
+worker(void *arg)
+{
+	struct _pfor *p = arg;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		size_t i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		if (i >= p->n)
+			return NULL;
+		p->fn(p->arg, i);
+	}
+}
+
+int
+pag_nb_threads(int threads)
+{
+	if (threads > 0)
+		return threads;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+void
+pag_parallel_for(int threads, size_t n, void (*fn)(void *, size_t),
+		void *arg)
+{
+	threads = pag_nb_threads(threads);
+	if ((size_t)threads > n)
+		threads = n;
+	if (threads <= 1) {
+		for (size_t i=0; i<n; i++)
+			fn(arg, i);
+		return;
+	}
+
+	struct _pfor p = {.next=0, .n=n, .fn=fn, .arg=arg};
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	int started = 0;
+	for (int i=0; i<threads-1; i++) {
+		if (pthread_create(&tids[started], NULL, worker, &p) == 0)
+			started++;
+	}
+	worker(&p); /* the calling thread works too */
+	for (int i=0; i<started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&p.lock);
+	free(tids);
+}
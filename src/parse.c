@@ -23,18 +23,22 @@ DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
+#include <sys/stat.h>
 #include "pagina.h"
 
 #define ERROR_BUFFER_SIZE 1000
 #define REGULAR_BUFFER_SIZE 1000
 #define STRING_BUFFER_SIZE 10000
 
-static char error_buffer[ERROR_BUFFER_SIZE];
-static char regular_buffer[REGULAR_BUFFER_SIZE];
-static char string_buffer[STRING_BUFFER_SIZE];
-static long error_pos = -1;
-static FILE *input;
+/* per thread, so that documents can be parsed in parallel */
+static _Thread_local char error_buffer[ERROR_BUFFER_SIZE];
+static _Thread_local char regular_buffer[REGULAR_BUFFER_SIZE];
+static _Thread_local char string_buffer[STRING_BUFFER_SIZE];
+static _Thread_local long error_pos = -1;
+static _Thread_local FILE *input;
+static _Thread_local off_t input_size; /* -1 if not a regular file */
 
 static void
 init_buffers(void)
@@ -49,13 +53,16 @@ init_parser(FILE *file)
 {
 	init_buffers();
 	input = file;
+	struct stat st;
+	input_size = fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)
+		? st.st_size : -1;
 }
 
 static char *
 str_from_buffer(char *buf, size_t n)
 {
 	char *str = malloc(sizeof(char)*(n+1));
-	strncpy(str, buf, n);
+	memcpy(str, buf, n);
 	str[n] = 0;
 	return str;
 }
@@ -955,15 +962,18 @@ parse_dict(void)
 struct _stream_res {
 	int err;
 	union {
-		char *str;
+		long offset;
 		parse_res_type errtype;
 	} val;
 };
 
+/* The stream data is not read into memory: only its offset is recorded, so
+that it can be copied straight from the input file when writing or loaded
+on demand by pag_read_raw_stream. */
 static struct _stream_res
 read_stream(size_t len)
 {
-	struct _stream_res res = {.err=0, .val.str=NULL};
+	struct _stream_res res = {.err=0, .val.offset=-1};
 	/* skip exactly one newline */
 	char ch = fgetc(input);
 	if (ch!='\r' && ch!='\n') {
@@ -979,18 +989,15 @@ read_stream(size_t len)
 			goto err_first_newline;
 	}
 
-	char *buf = calloc(len+1, 1); /* null-terminated for safety */
-
-	for (size_t i=0; i<len; i++) {
-		ch = fgetc(input);
-		if (feof(input)) {
-			err("Got EOF inside stream");
-			res.err = 1;
-			res.val.errtype = PARSE_ERROR;
-			return res;
-		}
-		buf[i] = ch;
-		/* TODO: verify EOD markers here */
+	long offset = ftell(input);
+	/* seeking past the end of a file succeeds, so compare with its size */
+	int truncated = input_size >= 0 && (off_t)len > input_size - offset;
+	/* TODO: verify EOD markers here */
+	if (truncated || fseek(input, offset + (long)len, SEEK_SET) != 0) {
+		err("Got EOF inside stream");
+		res.err = 1;
+		res.val.errtype = PARSE_ERROR;
+		return res;
 	}
 
 	token t = read_next();
@@ -1002,7 +1009,7 @@ read_stream(size_t len)
 		return res;
 	}
 
-	res.val.str = buf;
+	res.val.offset = offset;
 	return res;
 }
 
@@ -1055,7 +1062,9 @@ parse_indirect_object(void)
 		}
 
 		pag_stream *stm = pag_make_stream(direct_res->val.obj->val.dict,
-			stmres.val.str);
+			NULL);
+		stm->fd = fileno(input);
+		stm->offset = stmres.val.offset;
 		
 		token t5 = read_next();
 		if (t5.type != ENDOBJ_KW)
@@ -1104,7 +1113,7 @@ parse_xref_subsection(pag_xref_table *table)
 	long len = get_xref_integer(read_next());
 	if (len < 0) return res;
 
-	if (first+len < (long)table->len)
+	if (first+len > (long)table->len)
 		return result_parse_error(
 			"Xref subsection does not fit in table");
 
@@ -1114,7 +1123,8 @@ parse_xref_subsection(pag_xref_table *table)
 		long gen = get_xref_integer(read_next());
 		if (gen<0) return res;
 
-		int update = table->table[i].gen <= gen;
+		/* sections are read newest first, keep the first entry seen */
+		int update = table->table[i].pos == 0 && !table->table[i].free;
 
 		if (update) {
 			table->table[i].id = i;
@@ -1166,13 +1176,16 @@ parse_xref(pag_xref_table *table)
 	return res;
 }
 
+/* return -1 at the beginning of the file */
 static long
 next_line_backwards(void)
 {
-	fseek(input, -1, SEEK_CUR);
+	if (fseek(input, -1, SEEK_CUR) != 0)
+		return -1;
 	char ch = fgetc(input);
 	while (ch != '\n') {
-		fseek(input, -2, SEEK_CUR);
+		if (fseek(input, -2, SEEK_CUR) != 0)
+			return -1;
 		ch = fgetc(input);
 	}
 	ungetc(ch, input);
@@ -1189,7 +1202,11 @@ find_trailer(void)
 	int trailerfound = 0;
 
 	while (!trailerfound) {
-		next_line_backwards();
+		if (next_line_backwards() < 0) {
+			/* e.g. PDF 1.5 cross-reference streams */
+			err("No 'trailer' keyword found");
+			return -1;
+		}
 		t = peek_token();
 		trailerfound = (t.type==TRAILER_KW);
 	}
@@ -1197,6 +1214,23 @@ find_trailer(void)
 	return ftell(input);
 }
 
+/* Move forward to the 'trailer' keyword ending the xref section at the
+current position. */
+static long
+find_trailer_forward(void)
+{
+	const char *kw = "trailer";
+	int ch, matched = 0;
+	while ((ch = fgetc(input)) != EOF) {
+		matched = ch == kw[matched] ? matched+1 : ch == kw[0];
+		if (kw[matched] == 0) {
+			fseek(input, -matched, SEEK_CUR);
+			return ftell(input);
+		}
+	}
+	return -1;
+}
+
 static parse_res *
 parse_trailer(void)
 {
@@ -1225,20 +1259,132 @@ parse_trailer(void)
 }
 
 
+/* Read the trailer of the last xref section, with its position in
+res->pos. */
+static parse_res *
+read_last_trailer(long start_offset)
+{
+	if (find_trailer() < 0)
+		return NULL;
+	parse_res *res = parse_trailer();
+	if (res->type != FILE_TRAILER)
+		return NULL;
+
+	/* In linearized files the last trailer only gives /Size for the main
+	section; the full one follows the xref startxref points to. */
+	pag_dict *trailerdict = res->val.obj->val.dict;
+	if (pag_dict_get(trailerdict, pag_make_name("Root")) == NULL) {
+		long startxref = res->pos;
+		fseek(input, startxref + start_offset, SEEK_SET);
+		if (find_trailer_forward() < 0) {
+			err("No 'trailer' keyword found");
+			return NULL;
+		}
+		res = parse_trailer();
+		if (res->type != FILE_TRAILER)
+			return NULL;
+		res->pos = startxref;
+	}
+	return res;
+}
+
+/* Get the offset of object id from the xref section at xrefpos, or the
+ones before it: 0 if it is free or not listed, -1 on error. Entries take
+20 bytes, so the subsections are skipped over rather than read. */
+static long
+lookup_xref(long start_offset, long xrefpos, unsigned int id)
+{
+	for (int depth=0; depth < 1024; depth++) {
+		fseek(input, start_offset + xrefpos, SEEK_SET);
+		skip_comment_tokens();
+		if (read_next().type != XREF_KW)
+			return -1;
+		while (peek_token().type == INTEGER) {
+			long first = get_xref_integer(read_next());
+			long len = get_xref_integer(read_next());
+			if (first < 0 || len < 0)
+				return -1;
+			skip_whitespace();
+			long pos = ftell(input);
+			if (id >= first && id < first+len) {
+				char entry[18];
+				fseek(input, pos + 20*(id-first), SEEK_SET);
+				if (fread(entry, 1, 18, input) != 18
+				    || entry[10] != ' ' || entry[16] != ' ')
+					return -1;
+				if (entry[17] == 'f')
+					return 0;
+				return entry[17] == 'n'
+					? strtol(entry, NULL, 10) : -1;
+			}
+			fseek(input, pos + 20*len, SEEK_SET);
+		}
+		if (peek_token().type != TRAILER_KW)
+			return -1;
+		parse_res *res = parse_trailer();
+		if (res->type != FILE_TRAILER)
+			return -1;
+		pag_object *prev = pag_dict_get(res->val.obj->val.dict,
+			pag_make_name("Prev"));
+		if (prev == NULL)
+			return 0;
+		if (prev->type != PAG_INT || prev->val.intv.val < 0)
+			return -1;
+		xrefpos = prev->val.intv.val;
+	}
+	return -1;
+}
+
+/* Read object id of the file with the given last xref section, NULL if it
+cannot be found. */
+static pag_object *
+read_object_at(long start_offset, long xrefpos, unsigned int id)
+{
+	long pos = lookup_xref(start_offset, xrefpos, id);
+	if (pos <= 0)
+		return NULL;
+	fseek(input, start_offset + pos, SEEK_SET);
+	parse_res *res = parse_indirect_object();
+	pag_object *obj = res->type == INDIRECT_OBJ && res->val.ref.id == id
+		? res->val.ref.obj : NULL;
+	free(res);
+	return obj;
+}
+
+static pag_object *
+read_ref_at(long start_offset, long xrefpos, pag_object *obj)
+{
+	pag_ref *ref = pag_obj2ref(obj);
+	return ref != NULL ? read_object_at(start_offset, xrefpos, ref->id)
+		: NULL;
+}
+
+
 /**** exported functions ****/
 
 pag_object *
 pag_parse(FILE *file)
 {
-	(void)file;
-	return NULL; /* TODO */
+	init_parser(file);
+	parse_res *res = parse_direct_object();
+	pag_object *obj = res->type == DIRECT_OBJ ? res->val.obj : NULL;
+	free(res);
+	return obj;
 }
 
 pag_document *
-pag_parse_file(FILE *file)
+pag_open_file(FILE *file)
 {
 	pag_document *doc = malloc(sizeof(pag_document));
 	doc->trailer_dicts = NULL;
+	doc->cache = pag_make_stream_cache();
+	doc->fd = fileno(file);
+	doc->dirty = NULL;
+	doc->pagetree = NULL;
+	doc->input = file;
+	doc->index = NULL;
+	doc->indexlen = 0;
+	doc->refindex = NULL;
 
 	init_parser(file);
 
@@ -1251,15 +1397,11 @@ pag_parse_file(FILE *file)
 	doc->version = t.val.intv;
 	doc->start_offset = ftell(input);
 
-	find_trailer();
-	parse_res *res = parse_trailer();
-
-
-	if (res->type != FILE_TRAILER)
+	parse_res *res = read_last_trailer(doc->start_offset);
+	if (res == NULL)
 		return NULL;
-
 	pag_dict *trailerdict = res->val.obj->val.dict;
-	
+
 	doc->trailer_dicts = pag_array_append(doc->trailer_dicts, res->val.obj);
 
 	pag_object *obj;
@@ -1274,7 +1416,9 @@ pag_parse_file(FILE *file)
 	doc->table.table = calloc((size_t)doc->len+1, sizeof(pag_xref_entry));
 
 	doc->objs = calloc((size_t)doc->len, sizeof(pag_object));
+	doc->dirty = calloc((size_t)doc->len+1, 1);
 
+	doc->startxref = res->pos;
 	long xrefpos = res->pos + doc->start_offset;
 
 	fseek(input, xrefpos, SEEK_SET);
@@ -1305,15 +1449,154 @@ pag_parse_file(FILE *file)
 		pag_array_append(doc->trailer_dicts, res->val.obj);
 	}
 
-	for (int i=0; i<doc->len; i++) {
-		long pos = doc->start_offset + doc->table.table[i+1].pos;
-		fseek(input, pos, SEEK_SET);
-		res = parse_indirect_object();
-		if (res->type != INDIRECT_OBJ)
-			return NULL;
-		doc->objs[res->val.ref.id-1] = res->val.ref;
+	return doc;
+}
+
+/* Only the tail of the file and the few objects needed are read, each
+found in the xref sections without reading them whole. */
+pag_info *
+pag_open_info(FILE *file)
+{
+	init_parser(file);
+	skip_whitespace();
+	token t = peek_token();
+	if (t.type != PDF_VERSION_TOKEN) {
+		err("Expected PDF version");
+		return NULL;
+	}
+	long start = ftell(input);
+	parse_res *res = read_last_trailer(start);
+	if (res == NULL)
+		return NULL;
+	pag_object *trailerobj = res->val.obj;
+	pag_dict *trailer = trailerobj->val.dict;
+	long xrefpos = res->pos;
+	free(res);
+
+	pag_info *info = calloc(1, sizeof(pag_info));
+	info->version = t.val.intv;
+	info->nbpages = -1;
+	info->encrypted = pag_dict_get(trailer, pag_make_name("Encrypt"))
+		!= NULL;
+
+	pag_object *catalog = read_ref_at(start, xrefpos,
+		pag_dict_get(trailer, pag_make_name("Root")));
+	if (catalog != NULL && catalog->type == PAG_DICT) {
+		pag_dict *dict = catalog->val.dict;
+		pag_name *v = pag_obj2name(pag_dict_get(dict,
+			pag_make_name("Version")));
+		if (v != NULL && strlen(v->str) == 3 && v->str[1] == '.'
+		    && isdigit(v->str[0]) && isdigit(v->str[2])) {
+			int version = 10*(v->str[0]-'0') + v->str[2]-'0';
+			if (version > info->version)
+				info->version = version;
+		}
+		pag_object *pages = read_ref_at(start, xrefpos,
+			pag_dict_get(dict, pag_make_name("Pages")));
+		pag_object *count = pages != NULL && pages->type == PAG_DICT
+			? pag_dict_get(pages->val.dict, pag_make_name("Count"))
+			: NULL;
+		pag_object *indirect = read_ref_at(start, xrefpos, count);
+		if (indirect != NULL)
+			count = indirect;
+		if (count != NULL && count->type == PAG_INT
+		    && count->val.intv.val >= 0)
+			info->nbpages = count->val.intv.val;
+		pag_free_object(indirect);
+		pag_free_object(pages);
+	}
+	pag_free_object(catalog);
+
+	pag_object *obj = pag_dict_get(trailer, pag_make_name("Info"));
+	if (pag_obj2ref(obj) != NULL)
+		obj = read_ref_at(start, xrefpos, obj);
+	else
+		obj = pag_copy_object(obj);
+	if (obj != NULL && obj->type == PAG_DICT) {
+		info->info = obj->val.dict;
+		free(obj);
+		/* values may be indirect too */
+		for (int i=0; i < (1<<info->info->exp); i++) {
+			pag_object **val = &info->info->ht[i].obj;
+			if (pag_obj2ref(*val) != NULL) {
+				pag_object *ref = *val;
+				*val = read_ref_at(start, xrefpos, ref);
+				pag_free_object(ref);
+			}
+		}
+	} else {
+		pag_free_object(obj);
+	}
+	pag_free_object(trailerobj);
+	return info;
+}
+
+void
+pag_free_info(pag_info *info)
+{
+	if (info == NULL)
+		return;
+	if (info->info != NULL)
+		pag_free_object(pag_dict2obj(info->info));
+	free(info);
+}
+
+/* Read object id of a document opened with pag_open_file, if not read
+yet. */
+pag_object *
+pag_load_object(pag_document *doc, unsigned int id)
+{
+	if (id < 1 || id > (unsigned)doc->len)
+		return NULL;
+	if (doc->objs[id-1].obj != NULL || doc->input == NULL
+	    || id >= doc->table.len || doc->table.table[id].free
+	    || doc->table.table[id].pos == 0) /* not in any xref section */
+		return doc->objs[id-1].obj;
+
+	init_parser(doc->input);
+	fseek(input, doc->start_offset + doc->table.table[id].pos, SEEK_SET);
+	parse_res *res = parse_indirect_object();
+	if (res->type != INDIRECT_OBJ || res->val.ref.id != id) {
+		if (res->type == INDIRECT_OBJ)
+			pag_free_object(res->val.ref.obj);
+		free(res);
+		return NULL;
+	}
+	pag_ref ref = res->val.ref;
+	free(res);
+	pag_object *obj = ref.obj;
+	if (obj->type == PAG_STREAM) {
+		obj->val.stream->id = id;
+		obj->val.stream->cache = doc->cache;
 	}
+	pag_set_owner(obj, doc, id);
+	doc->objs[id-1] = ref;
+	return obj;
+}
 
+/* Read all objects not read yet; afterwards the document no longer needs
+its input. */
+int
+pag_load_all(pag_document *doc)
+{
+	if (doc->input == NULL)
+		return 0;
+	for (unsigned int id=1; id <= (unsigned)doc->len; id++) {
+		if (id < doc->table.len && !doc->table.table[id].free
+		    && doc->table.table[id].pos != 0
+		    && pag_load_object(doc, id) == NULL)
+			return -1;
+	}
+	doc->input = NULL;
+	return 0;
+}
+
+pag_document *
+pag_parse_file(FILE *file)
+{
+	pag_document *doc = pag_open_file(file);
+	if (doc == NULL || pag_load_all(doc) < 0)
+		return NULL;
 	return doc;
 }
 
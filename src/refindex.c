@@ -0,0 +1,262 @@
+/*
+Copyright 2023 Solano Felicio
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the “Software”),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "pagina.h"
+
+/* The reference index lists, for every object, the objects it refers to
+and those that refer to it, in compressed sparse rows: the ids in row id
+are ids[start[id]] to ids[start[id+1]-1], sorted and each listed once. Id
+0 stands for the trailer.
+
+Changing an object only flags it, through pag_mark_dirty: its row is read
+again from the object when asked for, and reverse lookups check the
+flagged objects besides the stored row. The rows are rebuilt once many
+objects are flagged. The trailer dictionary is given the document as owner
+with id 0, so that it flags itself like the objects do. */
+
+static void
+row_push(struct _idrow *r, unsigned int id)
+{
+	if (r->len == r->cap) {
+		r->cap = r->cap ? 2*r->cap : 16;
+		r->ids = realloc(r->ids, r->cap * sizeof(unsigned int));
+	}
+	r->ids[r->len++] = id;
+}
+
+static int
+cmp_ids(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+row_sort(struct _idrow *r)
+{
+	qsort(r->ids, r->len, sizeof(unsigned int), cmp_ids);
+	size_t n = 0;
+	for (size_t i=0; i<r->len; i++)
+		if (n == 0 || r->ids[i] != r->ids[n-1])
+			r->ids[n++] = r->ids[i];
+	r->len = n;
+}
+
+struct _collect {
+	struct _idrow *row;
+	unsigned int len;
+};
+
+static void
+collect_ref(pag_ref *ref, void *arg)
+{
+	struct _collect *c = arg;
+	if (ref->id >= 1 && ref->id <= c->len)
+		row_push(c->row, ref->id);
+}
+
+/* Read the row of object id from the object itself. */
+static void
+read_row(pag_document *doc, unsigned int id, struct _idrow *r)
+{
+	r->len = 0;
+	struct _collect c = {r, doc->len};
+	if (id == 0)
+		pag_for_each_ref(doc->trailer_dicts->val, collect_ref, &c);
+	else if (id <= (unsigned)doc->len)
+		pag_for_each_ref(doc->objs[id-1].obj, collect_ref, &c);
+	row_sort(r);
+}
+
+static void
+clear_changed(pag_refindex *ri)
+{
+	for (size_t i=0; i<ri->nchanged; i++) {
+		ri->slot[ri->changed[i].id] = 0;
+		free(ri->changed[i].row.ids);
+	}
+	ri->nchanged = 0;
+	ri->ninvalid = 0;
+}
+
+static void
+build(pag_refindex *ri)
+{
+	pag_document *doc = ri->doc;
+	clear_changed(ri);
+	free(ri->outstart);
+	free(ri->out);
+	free(ri->instart);
+	free(ri->in);
+	ri->len = doc->len;
+
+	struct _idrow all = {0}, r = {0};
+	ri->outstart = malloc(((size_t)ri->len+2) * sizeof(unsigned int));
+	for (unsigned int id=0; id<=ri->len; id++) {
+		ri->outstart[id] = all.len;
+		read_row(doc, id, &r);
+		for (size_t i=0; i<r.len; i++)
+			row_push(&all, r.ids[i]);
+	}
+	ri->outstart[ri->len+1] = all.len;
+	ri->out = all.ids;
+	free(r.ids);
+
+	/* sources are visited in order, so the reverse rows come out
+	sorted */
+	ri->instart = calloc((size_t)ri->len+2, sizeof(unsigned int));
+	for (size_t i=0; i<all.len; i++)
+		ri->instart[all.ids[i]+1]++;
+	for (unsigned int id=0; id<=ri->len; id++)
+		ri->instart[id+1] += ri->instart[id];
+	ri->in = malloc((all.len > 0 ? all.len : 1) * sizeof(unsigned int));
+	unsigned int *fill = malloc(((size_t)ri->len+1) * sizeof(unsigned int));
+	memcpy(fill, ri->instart, ((size_t)ri->len+1) * sizeof(unsigned int));
+	for (unsigned int id=0; id<=ri->len; id++)
+		for (unsigned int i=ri->outstart[id]; i<ri->outstart[id+1]; i++)
+			ri->in[fill[ri->out[i]]++] = id;
+	free(fill);
+}
+
+pag_refindex *
+pag_get_refindex(pag_document *doc)
+{
+	if (doc->refindex != NULL)
+		return doc->refindex;
+	if (pag_load_all(doc) < 0)
+		return NULL;
+	pag_refindex *ri = calloc(1, sizeof(pag_refindex));
+	ri->doc = doc;
+	pag_set_owner(doc->trailer_dicts->val, doc, 0);
+	build(ri);
+	doc->refindex = ri;
+	return ri;
+}
+
+void
+pag_refindex_touch(pag_refindex *ri, unsigned int id)
+{
+	if (id >= ri->nslots) {
+		unsigned int n = id+1 > (unsigned)ri->doc->len+1
+			? id+1 : (unsigned)ri->doc->len+1;
+		ri->slot = realloc(ri->slot, n * sizeof(unsigned int));
+		memset(ri->slot + ri->nslots, 0,
+			(n - ri->nslots) * sizeof(unsigned int));
+		ri->nslots = n;
+	}
+	if (ri->slot[id] != 0) {
+		struct _changed_row *c = &ri->changed[ri->slot[id]-1];
+		if (c->valid)
+			ri->ninvalid++;
+		c->valid = 0;
+		return;
+	}
+	if (ri->nchanged == ri->changedcap) {
+		ri->changedcap = ri->changedcap ? 2*ri->changedcap : 16;
+		ri->changed = realloc(ri->changed,
+			ri->changedcap * sizeof(struct _changed_row));
+	}
+	ri->changed[ri->nchanged] = (struct _changed_row){.id=id};
+	ri->slot[id] = ++ri->nchanged;
+	ri->ninvalid++;
+}
+
+/* Bring the rows of the changed objects up to date, or rebuild all rows
+if there are too many of them. */
+static void
+refresh(pag_refindex *ri)
+{
+	if (ri->ninvalid == 0)
+		return;
+	if (ri->nchanged > ri->len/16 + 64) {
+		build(ri);
+		return;
+	}
+	for (size_t i=0; i<ri->nchanged; i++) {
+		struct _changed_row *c = &ri->changed[i];
+		if (!c->valid) {
+			read_row(ri->doc, c->id, &c->row);
+			c->valid = 1;
+		}
+	}
+	ri->ninvalid = 0;
+}
+
+size_t
+pag_refs_from(pag_refindex *ri, unsigned int id, unsigned int **ids)
+{
+	refresh(ri);
+	ri->res.len = 0;
+	if (id < ri->nslots && ri->slot[id] != 0) {
+		struct _idrow *r = &ri->changed[ri->slot[id]-1].row;
+		for (size_t i=0; i<r->len; i++)
+			row_push(&ri->res, r->ids[i]);
+	} else if (id <= ri->len) {
+		for (unsigned int i=ri->outstart[id]; i<ri->outstart[id+1]; i++)
+			row_push(&ri->res, ri->out[i]);
+	}
+	*ids = ri->res.ids;
+	return ri->res.len;
+}
+
+size_t
+pag_refs_to(pag_refindex *ri, unsigned int id, unsigned int **ids)
+{
+	refresh(ri);
+	ri->res.len = 0;
+	if (id <= ri->len) {
+		for (unsigned int i=ri->instart[id]; i<ri->instart[id+1]; i++) {
+			unsigned int src = ri->in[i];
+			if (src >= ri->nslots || ri->slot[src] == 0)
+				row_push(&ri->res, src);
+		}
+	}
+	for (size_t i=0; i<ri->nchanged; i++) {
+		struct _idrow *r = &ri->changed[i].row;
+		if (bsearch(&id, r->ids, r->len, sizeof(unsigned int),
+		    cmp_ids) != NULL)
+			row_push(&ri->res, ri->changed[i].id);
+	}
+	row_sort(&ri->res);
+	*ids = ri->res.ids;
+	return ri->res.len;
+}
+
+void
+pag_invalidate_refindex(pag_document *doc)
+{
+	pag_refindex *ri = doc->refindex;
+	if (ri == NULL)
+		return;
+	clear_changed(ri);
+	free(ri->changed);
+	free(ri->slot);
+	free(ri->outstart);
+	free(ri->out);
+	free(ri->instart);
+	free(ri->in);
+	free(ri->res.ids);
+	free(ri);
+	doc->refindex = NULL;
+}
@@ -23,6 +23,7 @@ DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
 #include "pagina.h"
 
 #define newobj() (malloc(sizeof(pag_object)))
@@ -63,7 +64,7 @@ pag_string
 pag_make_string(char* str, size_t len)
 {
 	pag_string newstr = {len, malloc(sizeof(char) * len)};
-	strncpy(newstr.str, str, len);
+	memcpy(newstr.str, str, len);
 	return newstr;
 }
 
@@ -134,6 +135,8 @@ pag_make_array_single(pag_object *obj)
 	pag_array *arr = newarr();
 	arr->next = NULL;
 	arr->val = obj;
+	arr->doc = NULL;
+	arr->id = 0;
 	return arr;
 }
 
@@ -142,11 +145,16 @@ pag_array_append(pag_array *arr, pag_object *obj)
 {
 	if (arr == NULL)
 		return pag_make_array_single(obj);
-	if (arr->next == NULL) {
-		arr->next = pag_make_array_single(obj);
-		return arr;
+	pag_array *last = arr;
+	while (last->next != NULL)
+		last = last->next;
+	last->next = pag_make_array_single(obj);
+	if (arr->doc != NULL) {
+		last->next->doc = arr->doc;
+		last->next->id = arr->id;
+		pag_mark_dirty(arr->doc, arr->id);
+		pag_set_owner(obj, arr->doc, arr->id);
 	}
-	pag_array_append(arr->next, obj);
 	return arr;
 }
 
@@ -178,6 +186,8 @@ ht_new(int exp)
 	pag_dict *ht = malloc(sizeof(pag_dict));
 	ht->len = 0;
 	ht->exp = exp;
+	ht->doc = NULL;
+	ht->id = 0;
 	assert(exp >= 0);
 	assert(exp < 32);
 	ht->ht = calloc((size_t)1<<exp, sizeof(ht->ht[0]));
@@ -265,6 +275,10 @@ int
 pag_dict_set(pag_dict *dict, pag_name name, pag_object *obj)
 {
 	struct _ht_entry entry = {.key=name.str, .obj=obj};
+	if (dict->doc != NULL) {
+		pag_mark_dirty(dict->doc, dict->id);
+		pag_set_owner(obj, dict->doc, dict->id);
+	}
 	return ht_insert(dict, entry);
 }
 
@@ -278,13 +292,49 @@ pag_make_stream(pag_dict *dict, char *buf)
 		return NULL;
 	stm->len = lenobj->val.intv.val;
 	stm->stream = buf;
+	stm->fd = -1;
+	stm->offset = -1;
+	stm->id = 0;
+	stm->cache = NULL;
+	stm->decoded = NULL;
+	stm->decoded_len = 0;
+	stm->view = NULL;
 
 	return stm;
 }
 
+/* Read the raw data of a stream from the input file into a new buffer. */
+char *
+pag_load_raw_stream(pag_stream *stream)
+{
+	if (stream->fd < 0)
+		return NULL;
+
+	char *buf = calloc(stream->len+1, 1); /* null-terminated for safety */
+	size_t done = 0;
+	while (done < stream->len) {
+		ssize_t n = pread(stream->fd, buf+done, stream->len-done,
+			stream->offset+done);
+		if (n <= 0) {
+			free(buf);
+			return NULL;
+		}
+		done += n;
+	}
+
+	return buf;
+}
+
+char *
+pag_read_raw_stream(pag_stream *stream)
+{
+	if (stream->stream == NULL)
+		stream->stream = pag_load_raw_stream(stream);
+	return stream->stream;
+}
+
 pag_stmtype	pag_stream_get_type(pag_stream *stream);
 pag_dict	*pag_stream_get_dict(pag_stream *stream);
-char		*pag_read_stream(pag_stream *stream);
 int		pag_objstm_nbobjs(pag_stream *stream);
 int		pag_objstm_get_first_id(pag_stream *stream);
 unsigned int	pag_objstm_get_nbobjs(pag_stream *stream);
@@ -292,7 +342,6 @@ pag_object	*pag_objstm_get_obj(pag_stream *stream, int id);
 int		pag_objstm_reindex(pag_stream *stream, int oldid, int newid);
 int		pag_expand_objstm(pag_document *doc, pag_ref reference);
 int		pag_expand_all_objstm(pag_document *doc);
-pag_stream	*pag_make_objstm(pag_array references);
 int		pag_contract_objstm(pag_document *doc, pag_ref first, int n);
 
 
@@ -457,4 +506,129 @@ pag_ref2obj(pag_ref ref)
 	obj->type = PAG_REF;
 	obj->val.ref = ref;
 	return obj;
-}
\ No newline at end of file
+}
+
+static char *
+copy_chars(char *str, size_t len)
+{
+	char *copy = malloc(len+1);
+	memcpy(copy, str, len);
+	copy[len] = 0;
+	return copy;
+}
+
+pag_object *
+pag_copy_object(pag_object *obj)
+{
+	if (obj == NULL)
+		return NULL;
+	pag_object *copy = newobj();
+	*copy = *obj;
+	switch (obj->type) {
+	case PAG_STRING:
+		copy->val.str.str = copy_chars(obj->val.str.str,
+			obj->val.str.len);
+		break;
+	case PAG_NAME:
+		copy->val.name.str = copy_chars(obj->val.name.str,
+			strlen(obj->val.name.str));
+		break;
+	case PAG_ARRAY: {
+		pag_array *arr = NULL, *last = NULL;
+		for (pag_array *a = obj->val.array; a != NULL; a = a->next) {
+			pag_array *node = pag_make_array_single(
+				pag_copy_object(a->val));
+			if (last == NULL)
+				arr = node;
+			else
+				last->next = node;
+			last = node;
+		}
+		copy->val.array = arr;
+		break;
+	}
+	case PAG_DICT: {
+		pag_dict *dict = obj->val.dict;
+		pag_dict *dcopy = pag_make_empty_dict();
+		for (int i=0; i < (1<<dict->exp); i++)
+			if (dict->ht[i].key != NULL)
+				ht_insert(dcopy, (struct _ht_entry){
+					.key=copy_chars(dict->ht[i].key,
+						strlen(dict->ht[i].key)),
+					.obj=pag_copy_object(dict->ht[i].obj)});
+		copy->val.dict = dcopy;
+		break;
+	}
+	case PAG_STREAM: {
+		/* the raw data stays in the input file, anything in memory is
+		duplicated */
+		pag_stream *stm = obj->val.stream;
+		pag_stream *scopy = malloc(sizeof(pag_stream));
+		*scopy = *stm;
+		scopy->dict = pag_copy_object(pag_dict2obj(stm->dict))
+			->val.dict;
+		if (stm->stream != NULL) {
+			scopy->stream = malloc(stm->len+1);
+			memcpy(scopy->stream, stm->stream, stm->len);
+			scopy->stream[stm->len] = 0;
+		}
+		if (stm->decoded != NULL) {
+			scopy->decoded = malloc(stm->decoded_len+1);
+			memcpy(scopy->decoded, stm->decoded, stm->decoded_len);
+		}
+		scopy->id = 0;
+		scopy->cache = NULL;
+		scopy->view = NULL;
+		copy->val.stream = scopy;
+		break;
+	}
+	default:
+		break;
+	}
+	return copy;
+}
+
+void
+pag_free_object(pag_object *obj)
+{
+	if (obj == NULL)
+		return;
+	switch (obj->type) {
+	case PAG_STRING:
+		free(obj->val.str.str);
+		break;
+	case PAG_NAME:
+		free(obj->val.name.str);
+		break;
+	case PAG_ARRAY:
+		for (pag_array *a = obj->val.array, *next; a != NULL; a = next) {
+			next = a->next;
+			pag_free_object(a->val);
+			free(a);
+		}
+		break;
+	case PAG_DICT: {
+		pag_dict *dict = obj->val.dict;
+		for (int i=0; i < (1<<dict->exp); i++) {
+			free(dict->ht[i].key);
+			pag_free_object(dict->ht[i].obj);
+		}
+		free(dict->ht);
+		free(dict);
+		break;
+	}
+	case PAG_STREAM: {
+		pag_stream *stm = obj->val.stream;
+		pag_free_object(pag_dict2obj(stm->dict));
+		if (stm->fd >= 0) /* loaded by pag_read_raw_stream */
+			free(stm->stream);
+		free(stm->decoded);
+		free(stm->view);
+		free(stm);
+		break;
+	}
+	default:
+		break;
+	}
+	free(obj);
+}
@@ -113,7 +113,11 @@ pag_repl(pag_document *doc, FILE *output)
 			pag_ref *ref = pag_get_info(doc);
 			ref->obj = pag_make_info_dict();
 			pag_set_object(doc, *ref);
-			pag_write_document(doc, output);	
+			pag_write_document(doc, output, NULL);
+		}
+		else if (cmd[0]=='a') {
+			if (pag_write_incremental(doc, output, NULL) != 0)
+				printf("Error\n");
 		}
 		else if (cmd[0]=='r') {
 			pag_ref *ref = pag_get_root(doc);
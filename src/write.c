@@ -19,19 +19,196 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
 FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.
 */
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <zlib.h>
 #include "pagina.h"
 
-static FILE *output;
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define COPY_CHUNK_SIZE (1<<20)
+#define WRITE_BUFFER_SIZE (1<<18)
+#define OBJS_PER_CHUNK 1024
+
+/* Stream data that is still in the input file, to be copied to the output
+when the buffer is emitted. It goes right before buffer offset at. */
+struct _segment {
+	size_t at;
+	int fd;
+	off_t offset;
+	size_t len;
+};
+
+/* Output goes through a large buffer that is flushed with write(2), or
+handed to a callback. The writer keeps track of the output offset itself.
+Without either, the buffer just grows and holds the whole output. */
+struct _writer {
+	char *buf;
+	size_t len;
+	size_t cap;
+	long pos; /* offset of the next byte in the output */
+	int fd; /* -1 to write to memory or through fn */
+	int (*fn)(void *arg, const char *buf, size_t len);
+	void *arg;
+	int err;
+	int compact; /* write only the whitespace PDF requires */
+	char last; /* last byte written, to know if a separator is needed */
+	int defer; /* memory writer: record unloaded streams as segments */
+	struct _segment *segs;
+	size_t nsegs;
+	size_t capsegs;
+};
+
+static void
+init_writer(struct _writer *w, int fd)
+{
+	w->fd = fd;
+	w->fn = NULL;
+	w->arg = NULL;
+	w->cap = WRITE_BUFFER_SIZE;
+	w->buf = malloc(w->cap);
+	w->len = 0;
+	w->err = 0;
+	w->pos = 0;
+	w->compact = 0;
+	w->last = '\n';
+	w->defer = 0;
+	w->segs = NULL;
+	w->nsegs = 0;
+	w->capsegs = 0;
+	if (fd >= 0) {
+		off_t pos = lseek(fd, 0, SEEK_CUR);
+		if (pos > 0)
+			w->pos = pos;
+	}
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+flush(struct _writer *w)
+{
+	if (w->len == 0 || (w->fd < 0 && w->fn == NULL))
+		return;
+	if (w->fd >= 0 ? write_all(w->fd, w->buf, w->len)
+	    : w->fn(w->arg, w->buf, w->len))
+		w->err = 1;
+	w->len = 0;
+}
+
+/* Make room for n more bytes in the buffer. */
+static char *
+reserve(struct _writer *w, size_t n)
+{
+	if (w->len + n > w->cap) {
+		flush(w);
+		if (w->len + n > w->cap) {
+			while (w->len + n > w->cap)
+				w->cap *= 2;
+			w->buf = realloc(w->buf, w->cap);
+		}
+	}
+	return w->buf + w->len;
+}
+
+/* Send n bytes after the buffered ones, without going through the buffer
+if they are many. The output offset is left to the caller. */
+static void
+emit_raw(struct _writer *w, const char *s, size_t n)
+{
+	if (n < WRITE_BUFFER_SIZE || (w->fd < 0 && w->fn == NULL)) {
+		memcpy(reserve(w, n), s, n);
+		w->len += n;
+		return;
+	}
+	flush(w);
+	if (w->fd >= 0 ? write_all(w->fd, s, n) : w->fn(w->arg, s, n))
+		w->err = 1;
+}
+
+static void
+put(struct _writer *w, const char *s, size_t n)
+{
+	emit_raw(w, s, n);
+	w->pos += n;
+	if (n > 0)
+		w->last = s[n-1];
+}
 
 static void
-init_writer(FILE* file)
+puts_w(struct _writer *w, const char *s)
 {
-	output = file;
+	put(w, s, strlen(s));
 }
 
+static void
+putc_w(struct _writer *w, char ch)
+{
+	*reserve(w, 1) = ch;
+	w->len++;
+	w->pos++;
+	w->last = ch;
+}
+
+/* Write an unsigned integer with at least width digits. */
+static void
+put_uint(struct _writer *w, unsigned long v, int width)
+{
+	char tmp[24];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + v%10;
+		v /= 10;
+	} while (v != 0);
+	while (n < width)
+		tmp[n++] = '0';
+
+	char *p = reserve(w, n);
+	for (int i=0; i<n; i++)
+		p[i] = tmp[n-1-i];
+	w->len += n;
+	w->pos += n;
+	w->last = tmp[0];
+}
+
+static void
+put_int(struct _writer *w, long v)
+{
+	if (v < 0) {
+		putc_w(w, '-');
+		put_uint(w, -(unsigned long)v, 1);
+	} else {
+		put_uint(w, v, 1);
+	}
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
 static int
 contains_special_ch(char *str, unsigned len) {
 	for (size_t i=0; i<len; i++) {
@@ -42,135 +219,2345 @@ contains_special_ch(char *str, unsigned len) {
 }
 
 static void
-write_hex_string(char *str, unsigned len) {
-	fprintf(output, "<");
+write_hex_string(struct _writer *w, char *str, unsigned len) {
+	char *p = reserve(w, 2*(size_t)len + 2);
+	*p++ = '<';
+	for (size_t i=0; i<len; i++) {
+		*p++ = hexdigits[(unsigned char)str[i] >> 4];
+		*p++ = hexdigits[(unsigned char)str[i] & 15];
+	}
+	*p++ = '>';
+	w->len += 2*(size_t)len + 2;
+	w->pos += 2*(size_t)len + 2;
+	w->last = '>';
+}
+
+static void
+write_literal_string(struct _writer *w, char *str, size_t len) {
+	putc_w(w, '(');
+	size_t start = 0;
 	for (size_t i=0; i<len; i++) {
-		fprintf(output, "%02x", (unsigned char)str[i]);
+		if (str[i] != '(' && str[i] != ')' && str[i] != '\\')
+			continue;
+		put(w, str+start, i-start);
+		putc_w(w, '\\');
+		start = i;
+	}
+	put(w, str+start, len-start);
+	putc_w(w, ')');
+}
+
+static int
+is_regular(char ch)
+{
+	return ch != 0 && ch != 9 && ch != 10 && ch != 12 && ch != 13
+		&& ch != 32 && ch != '(' && ch != ')' && ch != '<' && ch != '>'
+		&& ch != '[' && ch != ']' && ch != '{' && ch != '}'
+		&& ch != '/' && ch != '%';
+}
+
+/* In compact mode, separate two tokens only if they would merge. */
+static void
+separate(struct _writer *w, char next)
+{
+	if (is_regular(w->last) && is_regular(next))
+		putc_w(w, ' ');
+}
+
+static void
+write_name(struct _writer *w, char *name) {
+	putc_w(w, '/');
+	for (; *name; name++) {
+		unsigned char ch = *name;
+		if (ch < 33 || ch > 126 || ch == '#' || ch == '(' || ch == ')'
+		    || ch == '<' || ch == '>' || ch == '[' || ch == ']'
+		    || ch == '{' || ch == '}' || ch == '/' || ch == '%') {
+			putc_w(w, '#');
+			putc_w(w, hexdigits[ch >> 4]);
+			putc_w(w, hexdigits[ch & 15]);
+		} else {
+			putc_w(w, ch);
+		}
+	}
+}
+
+/* Copy len bytes at offset off of file in to the current position of file
+out, letting the kernel move the data whenever it can. Return zero on
+success. */
+static int
+copy_range(int in, off_t off, int out, size_t len)
+{
+#ifdef __linux__
+	while (len > 0) {
+		ssize_t n = copy_file_range(in, &off, out, NULL, len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+	while (len > 0) {
+		ssize_t n = sendfile(out, in, &off, len);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+#endif
+	if (len == 0)
+		return 0;
+
+	char *buf = malloc(len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE);
+	while (len > 0) {
+		size_t chunk = len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE;
+		ssize_t n = pread(in, buf, chunk, off);
+		if (n <= 0 || write_all(out, buf, n) != 0)
+			break;
+		off += n;
+		len -= n;
+	}
+	free(buf);
+	return len != 0;
+}
+
+/* Send len bytes at offset off of file in, like emit_raw. */
+static void
+copy_in(struct _writer *w, int in, off_t off, size_t len)
+{
+	if (w->fd >= 0) {
+		flush(w);
+		if (copy_range(in, off, w->fd, len) != 0)
+			w->err = 1;
+		return;
+	}
+	while (len > 0) {
+		size_t chunk = len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE;
+		char *p = reserve(w, chunk);
+		ssize_t n = pread(in, p, chunk, off);
+		if (n <= 0) {
+			w->err = 1;
+			return;
+		}
+		w->len += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static void
+write_stream_data(struct _writer *w, pag_stream *stream)
+{
+	if (stream->stream != NULL || stream->fd < 0) {
+		put(w, stream->stream, stream->len);
+		return;
+	}
+
+	if (w->defer) {
+		if (w->nsegs == w->capsegs) {
+			w->capsegs = w->capsegs ? 2*w->capsegs : 16;
+			w->segs = realloc(w->segs,
+				w->capsegs * sizeof(struct _segment));
+		}
+		struct _segment seg = {w->len, stream->fd, stream->offset,
+			stream->len};
+		w->segs[w->nsegs++] = seg;
+		w->pos += stream->len;
+		w->last = 0;
+		return;
 	}
-	fprintf(output, ">");
+
+	/* unmodified stream: copy it straight from the input file */
+	copy_in(w, stream->fd, stream->offset, stream->len);
+	w->pos += stream->len;
+	w->last = 0;
 }
 
 static void
-write_obj(pag_object *obj, int nl, unsigned tl)
+write_obj(struct _writer *w, pag_object *obj, int nl, unsigned tl)
 {
 	/* nl = end with newline */
 	/* tl = tab level */
+	char buf[PAG_REAL_BUFSIZE];
 	switch (obj->type) {
 	case PAG_STRING:
-		if (!contains_special_ch(obj->val.str.str, obj->val.str.len)) {
-			fprintf(output, "(");
-			fwrite(obj->val.str.str, 1, obj->val.str.len, output);
-			fprintf(output, ")");
-		} else {
-			write_hex_string(obj->val.str.str, obj->val.str.len);
-		}
-		fprintf(output, nl?"\n":" ");
+		if (!contains_special_ch(obj->val.str.str, obj->val.str.len))
+			write_literal_string(w, obj->val.str.str,
+				obj->val.str.len);
+		else
+			write_hex_string(w, obj->val.str.str, obj->val.str.len);
+		putc_w(w, nl ? '\n' : ' ');
 		break;
 	case PAG_BOOL:
-		fprintf(output, obj->val.boolv.val?"true":"false");
-		fprintf(output, nl ? "\n" : " ");
+		puts_w(w, obj->val.boolv.val ? "true" : "false");
+		putc_w(w, nl ? '\n' : ' ');
 		break;
 	case PAG_ARRAY:
-		fprintf(output, "[");
+		putc_w(w, '[');
 		pag_array *arr = obj->val.array;
 		while (arr != NULL) {
-			fprintf(output, " ");
-			write_obj(arr->val, 0, 0);
+			putc_w(w, ' ');
+			write_obj(w, arr->val, 0, 0);
 			arr = arr->next;
 		}
-		fprintf(output, nl?"]\n":"] ");
+		puts_w(w, nl ? "]\n" : "] ");
 		break;
 	case PAG_DICT:
-		fprintf(output, nl?"<<\n":"<<");
+		puts_w(w, nl ? "<<\n" : "<<");
 		pag_dict *dict = obj->val.dict;
 		for (int i=0; i < (1<<dict->exp); i++) {
 			if (dict->ht[i].obj != NULL) {
 				if (nl)
 					for (unsigned j=0; j<tl; j++)
-						fprintf(output, "\t");
-				fprintf(output, nl?"/%s ":" /%s ",
-						dict->ht[i].key);
-				write_obj(dict->ht[i].obj, 1, tl+1);
+						putc_w(w, '\t');
+				if (!nl)
+					putc_w(w, ' ');
+				write_name(w, dict->ht[i].key);
+				putc_w(w, ' ');
+				write_obj(w, dict->ht[i].obj, 1, tl+1);
 			}
 		}
 		if (nl)
 			for (unsigned j=0; j<tl-1; j++)
-				fprintf(output, "\t");
-		fprintf(output, nl?">>\n":">> ");
+				putc_w(w, '\t');
+		puts_w(w, nl ? ">>\n" : ">> ");
 		break;
-	case PAG_FLOAT:
-		fprintf(output, nl?"%f\n":"%f ", obj->val.floatv.val);
+	case PAG_FLOAT: {
+		int n = pag_format_real(obj->val.floatv.val, buf);
+		if (n < 0) {
+			w->err = 1;
+			break;
+		}
+		put(w, buf, n);
+		putc_w(w, nl ? '\n' : ' ');
 		break;
+	}
 	case PAG_INT:
-		fprintf(output, nl?"%d\n":"%d ", obj->val.intv.val);
+		put_int(w, obj->val.intv.val);
+		putc_w(w, nl ? '\n' : ' ');
 		break;
 	case PAG_NAME:
-		fprintf(output, nl?"/%s\n":"/%s ", obj->val.name.str);
+		write_name(w, obj->val.name.str);
+		putc_w(w, nl ? '\n' : ' ');
 		break;
 	case PAG_REF:
-		fprintf(output, "%d %d R", obj->val.ref.id, obj->val.ref.gen);
-		fprintf(output, nl?"\n":" ");
+		put_uint(w, obj->val.ref.id, 1);
+		putc_w(w, ' ');
+		put_uint(w, obj->val.ref.gen, 1);
+		puts_w(w, nl ? " R\n" : " R ");
 		break;
 	case PAG_NULL:
-		fprintf(output, nl?"null\n":"null "); break;
+		puts_w(w, nl ? "null\n" : "null ");
+		break;
 	case PAG_STREAM:
-		write_obj(pag_dict2obj(obj->val.stream->dict), 1, tl);
-		fprintf(output, "stream\n");
-		fwrite(obj->val.stream->stream, 1, obj->val.stream->len, output);
-		//fprintf(output, "STREAM GOES HERE");
-		fprintf(output, "\nendstream\n");
+		if (pag_encode_stream(obj->val.stream) != 0) {
+			w->err = 1;
+			break;
+		}
+		write_obj(w, pag_dict2obj(obj->val.stream->dict), 1, tl);
+		puts_w(w, "stream\n");
+		write_stream_data(w, obj->val.stream);
+		puts_w(w, "\nendstream\n");
 		break;
+	}
+}
 
+/* Same as write_obj, without the layout. */
+static void
+write_obj_compact(struct _writer *w, pag_object *obj)
+{
+	char buf[PAG_REAL_BUFSIZE];
+	switch (obj->type) {
+	case PAG_STRING:
+		if (!contains_special_ch(obj->val.str.str, obj->val.str.len))
+			write_literal_string(w, obj->val.str.str,
+				obj->val.str.len);
+		else
+			write_hex_string(w, obj->val.str.str, obj->val.str.len);
+		break;
+	case PAG_BOOL:
+		separate(w, 't');
+		puts_w(w, obj->val.boolv.val ? "true" : "false");
+		break;
+	case PAG_ARRAY:
+		putc_w(w, '[');
+		for (pag_array *arr = obj->val.array; arr; arr = arr->next)
+			write_obj_compact(w, arr->val);
+		putc_w(w, ']');
+		break;
+	case PAG_DICT:
+		puts_w(w, "<<");
+		pag_dict *dict = obj->val.dict;
+		for (int i=0; i < (1<<dict->exp); i++) {
+			if (dict->ht[i].obj != NULL) {
+				write_name(w, dict->ht[i].key);
+				write_obj_compact(w, dict->ht[i].obj);
+			}
+		}
+		puts_w(w, ">>");
+		break;
+	case PAG_FLOAT: {
+		int n = pag_format_real(obj->val.floatv.val, buf);
+		if (n < 0) {
+			w->err = 1;
+			break;
+		}
+		separate(w, buf[0]);
+		put(w, buf, n);
+		break;
+	}
+	case PAG_INT:
+		separate(w, '0');
+		put_int(w, obj->val.intv.val);
+		break;
+	case PAG_NAME:
+		write_name(w, obj->val.name.str);
+		break;
+	case PAG_REF:
+		separate(w, '0');
+		put_uint(w, obj->val.ref.id, 1);
+		putc_w(w, ' ');
+		put_uint(w, obj->val.ref.gen, 1);
+		puts_w(w, " R");
+		break;
+	case PAG_NULL:
+		separate(w, 'n');
+		puts_w(w, "null");
+		break;
+	case PAG_STREAM:
+		if (pag_encode_stream(obj->val.stream) != 0) {
+			w->err = 1;
+			break;
+		}
+		write_obj_compact(w, pag_dict2obj(obj->val.stream->dict));
+		puts_w(w, "stream\n");
+		write_stream_data(w, obj->val.stream);
+		puts_w(w, "\nendstream");
+		break;
 	}
 }
 
 void
-write_indirect_obj(pag_ref ref) {
-	fprintf(output, "%d %d obj\n", ref.id, ref.gen);
-	write_obj(ref.obj, 1, 1);
-	fprintf(output, "endobj\n");
+write_indirect_obj(struct _writer *w, pag_ref ref) {
+	put_uint(w, ref.id, 1);
+	putc_w(w, ' ');
+	put_uint(w, ref.gen, 1);
+	if (w->compact) {
+		puts_w(w, " obj");
+		write_obj_compact(w, ref.obj);
+		separate(w, 'e');
+		puts_w(w, "endobj\n");
+		return;
+	}
+	puts_w(w, " obj\n");
+	write_obj(w, ref.obj, 1, 1);
+	puts_w(w, "endobj\n");
 }
 
 void
-write_pdf_version(pag_document *doc) {
-	fprintf(output, "%%PDF-%d.%d\n",
-		doc->version/10, doc->version%10);
+write_pdf_version(struct _writer *w, int version) {
+	puts_w(w, "%PDF-");
+	put_uint(w, version/10, 1);
+	putc_w(w, '.');
+	put_uint(w, version%10, 1);
+	putc_w(w, '\n');
 }
 
+/* arr[i] is the offset of object i+1, or 0 if it is free */
 void
-write_xref(unsigned long *arr, int len) {
-	fprintf(output, "xref\n");
-	fprintf(output, "0 %d\n", len+1);
-	fprintf(output, "0000000000 65535 f");
+write_xref(struct _writer *w, long *arr, int len) {
+	/* free entries form a list starting at object 0 */
+	int *nextfree = malloc((len+1) * sizeof(int));
+	nextfree[len] = 0;
+	for (int i=len-1; i>=0; i--)
+		nextfree[i] = arr[i] == 0 ? i+1 : nextfree[i+1];
+
+	puts_w(w, "xref\n0 ");
+	put_uint(w, len+1, 1);
+	putc_w(w, '\n');
+	put_uint(w, nextfree[0], 10);
+	puts_w(w, " 65535 f \n");
 	for (int i=0; i<len; i++) {
-		fprintf(output, "%010ld 00000 n\n", arr[i]);
+		if (arr[i] != 0) {
+			put_uint(w, arr[i], 10);
+			puts_w(w, " 00000 n \n");
+		} else {
+			put_uint(w, nextfree[i+1], 10);
+			puts_w(w, " 00001 f \n");
+		}
+	}
+	free(nextfree);
+}
+
+/* Trailer for a new xref section: the entries of the document trailer that
+still apply, and the new /Size. */
+static pag_dict *
+make_trailer(pag_dict *trailer, long size)
+{
+	pag_dict *dict = pag_make_empty_dict();
+	char *keys[] = {"Root", "Info", "ID", "Encrypt"};
+	for (size_t i=0; i<sizeof(keys)/sizeof(keys[0]); i++) {
+		pag_object *obj = pag_dict_get(trailer, pag_make_name(keys[i]));
+		if (obj != NULL)
+			pag_dict_set(dict, pag_make_name(keys[i]), obj);
 	}
+	pag_dict_set(dict, pag_make_name("Size"),
+		pag_int2obj(pag_make_int(size)));
+	return dict;
 }
 
 void
-write_trailer(unsigned long startxref, pag_object *dict) {
-	fprintf(output, "trailer\n");
-	write_obj(dict, 1, 1);
-	fprintf(output, "startxref\n%ld\n%%%%EOF", startxref);
+write_trailer(struct _writer *w, long startxref, pag_object *dict) {
+	puts_w(w, "trailer\n");
+	if (w->compact) {
+		write_obj_compact(w, dict);
+		putc_w(w, '\n');
+	} else {
+		write_obj(w, dict, 1, 1);
+	}
+	puts_w(w, "startxref\n");
+	put_uint(w, startxref, 1);
+	puts_w(w, "\n%%EOF\n");
 }
 
-int
-pag_write_document(pag_document *doc, FILE *file)
+pag_stream *
+pag_make_objstm(pag_array *references)
 {
-	init_writer(file);
+	struct _writer header, body;
+	init_writer(&header, -1);
+	init_writer(&body, -1);
+	body.compact = 1;
 
-	write_pdf_version(doc);
+	int n = 0;
+	for (pag_array *a = references; a != NULL; a = a->next) {
+		pag_ref *ref = pag_obj2ref(a->val);
+		if (ref == NULL || ref->obj == NULL || ref->gen != 0
+		    || ref->obj->type == PAG_STREAM) {
+			free(header.buf);
+			free(body.buf);
+			return NULL;
+		}
+		if (n > 0) {
+			putc_w(&header, ' ');
+			putc_w(&body, '\n');
+		}
+		put_uint(&header, ref->id, 1);
+		putc_w(&header, ' ');
+		put_uint(&header, body.pos, 1);
+		write_obj_compact(&body, ref->obj);
+		n++;
+	}
+	putc_w(&header, '\n');
+	put(&header, body.buf, body.len);
+	free(body.buf);
+	if (body.err) {
+		free(header.buf);
+		return NULL;
+	}
 
-	unsigned long *arr = calloc(doc->len, sizeof(unsigned long));
-	for (int i=0; i < doc->len; i++) {
-		arr[i] = ftell(file);
-		write_indirect_obj(doc->objs[i]);
+	size_t len;
+	char *data = pag_flate_encode(header.buf, header.len,
+		Z_DEFAULT_COMPRESSION, &len);
+	if (data == NULL) {
+		free(header.buf);
+		return NULL;
 	}
 
-	unsigned long startxref = ftell(file);
-	write_xref(arr, doc->len);
-	write_trailer(startxref, doc->trailer_dicts->val);
+	pag_dict *dict = pag_make_empty_dict();
+	pag_dict_set(dict, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("ObjStm")));
+	pag_dict_set(dict, pag_make_name("N"), pag_int2obj(pag_make_int(n)));
+	pag_dict_set(dict, pag_make_name("First"),
+		pag_int2obj(pag_make_int(header.len - body.len)));
+	pag_dict_set(dict, pag_make_name("Filter"),
+		pag_name2obj(pag_make_name("FlateDecode")));
+	pag_dict_set(dict, pag_make_name("Length"),
+		pag_int2obj(pag_make_int(len)));
 
-	free(arr);
+	free(header.buf);
+	return pag_make_stream(dict, data);
+}
+
+
+/**** compressed (PDF 1.5) output ****/
+
+struct _xrefstm_entry {
+	int type; /* 0 free, 1 at offset, 2 in object stream */
+	long f2; /* next free, offset or object stream id */
+	long f3; /* generation or index in the object stream */
+};
+
+static int
+nbytes(unsigned long v)
+{
+	int n = 0;
+	for (; v != 0; v >>= 8)
+		n++;
+	return n;
+}
+
+static int
+objstm_eligible(pag_ref ref)
+{
+	return ref.obj != NULL && ref.obj->type != PAG_STREAM && ref.gen == 0;
+}
+
+/* Write the cross-reference stream, with the smallest /W widths that fit
+the entries, and return its offset. */
+static long
+write_xref_stream(struct _writer *w, struct _xrefstm_entry *xs,
+		unsigned int size, pag_dict *trailer)
+{
+	unsigned int id = size-1;
+	xs[id].type = 1;
+	xs[id].f2 = w->pos;
+	xs[id].f3 = 0;
+
+	unsigned long max2 = 0, max3 = 0;
+	for (unsigned int i=0; i<size; i++) {
+		if ((unsigned long)xs[i].f2 > max2)
+			max2 = xs[i].f2;
+		if ((unsigned long)xs[i].f3 > max3)
+			max3 = xs[i].f3;
+	}
+	int w2 = nbytes(max2), w3 = nbytes(max3);
+
+	size_t rowlen = 1 + w2 + w3;
+	unsigned char *rows = malloc(size * rowlen);
+	for (unsigned int i=0; i<size; i++) {
+		unsigned char *row = rows + i*rowlen;
+		row[0] = xs[i].type;
+		for (int j=0; j<w2; j++)
+			row[1+j] = xs[i].f2 >> 8*(w2-1-j);
+		for (int j=0; j<w3; j++)
+			row[1+w2+j] = xs[i].f3 >> 8*(w3-1-j);
+	}
+
+	size_t len;
+	char *data = pag_flate_encode((char *)rows, size*rowlen,
+		Z_DEFAULT_COMPRESSION, &len);
+	free(rows);
+
+	pag_dict *dict = make_trailer(trailer, size);
+	pag_dict_set(dict, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("XRef")));
+	pag_array *warr = pag_make_array_single(pag_int2obj(pag_make_int(1)));
+	pag_array_append(warr, pag_int2obj(pag_make_int(w2)));
+	pag_array_append(warr, pag_int2obj(pag_make_int(w3)));
+	pag_dict_set(dict, pag_make_name("W"), pag_array2obj(warr));
+	pag_dict_set(dict, pag_make_name("Filter"),
+		pag_name2obj(pag_make_name("FlateDecode")));
+	pag_dict_set(dict, pag_make_name("Length"),
+		pag_int2obj(pag_make_int(len)));
+
+	long pos = w->pos;
+	pag_stream *stm = pag_make_stream(dict, data);
+	write_indirect_obj(w, pag_make_ref(id, 0, pag_stream2obj(stm)));
+	free(data);
+	return pos;
+}
+
+/* Pack non-stream objects into object streams of perstm objects each, and
+index everything with a cross-reference stream. */
+static void
+write_compressed(struct _writer *w, pag_document *doc, int perstm)
+{
+	pag_dict *trailer = doc->trailer_dicts->val->val.dict;
+	int neligible = 0;
+	for (int i=0; i<doc->len; i++)
+		neligible += objstm_eligible(doc->objs[i]);
+	int nstm = (neligible + perstm-1) / perstm;
+	unsigned int size = doc->len + nstm + 2;
+	struct _xrefstm_entry *xs = calloc(size, sizeof(*xs));
+
+	for (int i=0; i<doc->len; i++) {
+		pag_ref ref = doc->objs[i];
+		if (ref.obj == NULL || objstm_eligible(ref))
+			continue;
+		xs[i+1].type = 1;
+		xs[i+1].f2 = w->pos;
+		xs[i+1].f3 = ref.gen;
+		write_indirect_obj(w, ref);
+	}
+
+	int i = 0;
+	for (int k=0; k<nstm; k++) {
+		unsigned int stmid = doc->len + 1 + k;
+		pag_array *refs = NULL, *last = NULL;
+		for (int n=0; n<perstm && i<doc->len; i++) {
+			if (!objstm_eligible(doc->objs[i]))
+				continue;
+			pag_array *node = pag_make_array_single(
+				pag_ref2obj(doc->objs[i]));
+			if (last == NULL)
+				refs = node;
+			else
+				last->next = node;
+			last = node;
+			xs[i+1].type = 2;
+			xs[i+1].f2 = stmid;
+			xs[i+1].f3 = n++;
+		}
+
+		pag_stream *stm = pag_make_objstm(refs);
+		if (stm == NULL) {
+			w->err = 1;
+			pag_free_object(pag_array2obj(refs));
+			continue;
+		}
+		pag_object *stmobj = pag_stream2obj(stm);
+		xs[stmid].type = 1;
+		xs[stmid].f2 = w->pos;
+		write_indirect_obj(w, pag_make_ref(stmid, 0, stmobj));
+		free(stm->stream);
+		pag_free_object(stmobj);
+		pag_free_object(pag_array2obj(refs));
+	}
+
+	/* free entries form a list starting at object 0 */
+	unsigned int nextfree = 0;
+	for (unsigned int id=size-1; id-- > 0; ) {
+		if (xs[id].type != 0)
+			continue;
+		xs[id].f2 = nextfree;
+		xs[id].f3 = id == 0 ? 0 : 1;
+		nextfree = id;
+	}
+
+	long startxref = write_xref_stream(w, xs, size, trailer);
+	puts_w(w, "startxref\n");
+	put_uint(w, startxref, 1);
+	puts_w(w, "\n%%EOF\n");
+	free(xs);
+}
+
+/**** parallel serialization ****/
+
+/* Objects are serialized in chunks, each into its own memory writer, and
+the chunks are then emitted in order. Offsets inside a chunk are relative
+to its start until the sizes of the previous chunks are known. */
+struct _chunk {
+	struct _writer w;
+	long *offs; /* relative offset of each object, 0 if free */
+};
+
+struct _serialize_job {
+	pag_document *doc;
+	struct _chunk *chunks;
+	int compact;
+};
+
+static void
+serialize_chunk(void *arg, size_t k)
+{
+	struct _serialize_job *job = arg;
+	struct _chunk *c = &job->chunks[k];
+	int first = k * OBJS_PER_CHUNK;
+	int n = job->doc->len - first;
+	if (n > OBJS_PER_CHUNK)
+		n = OBJS_PER_CHUNK;
+
+	init_writer(&c->w, -1);
+	c->w.compact = job->compact;
+	c->w.defer = 1;
+	c->offs = calloc(n, sizeof(long));
+	for (int i=0; i<n; i++) {
+		pag_ref ref = job->doc->objs[first+i];
+		if (ref.obj == NULL)
+			continue;
+		c->offs[i] = c->w.pos + 1; /* keep 0 for free objects */
+		write_indirect_obj(&c->w, ref);
+	}
+}
+
+static int
+writev_all(int fd, struct iovec *iov, int niov)
+{
+	int i = 0;
+	while (i < niov) {
+		ssize_t n = writev(fd, iov+i, niov-i);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		while (i < niov && (size_t)n >= iov[i].iov_len)
+			n -= iov[i++].iov_len;
+		if (i < niov) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Send the chunk buffers to w, copying the deferred stream data in
+between. Files get them with writev. */
+static void
+emit_chunks(struct _writer *w, struct _chunk *chunks, size_t nchunks)
+{
+	struct iovec iov[IOV_MAX];
+	int niov = 0;
+
+	flush(w);
+	for (size_t k=0; k<nchunks && !w->err; k++) {
+		struct _writer *c = &chunks[k].w;
+		if (c->err) {
+			w->err = 1;
+			return;
+		}
+		size_t from = 0;
+		for (size_t j=0; j<=c->nsegs; j++) {
+			size_t to = j < c->nsegs ? c->segs[j].at : c->len;
+			if (w->fd < 0) {
+				emit_raw(w, c->buf + from, to - from);
+			} else if (to > from) {
+				iov[niov].iov_base = c->buf + from;
+				iov[niov].iov_len = to - from;
+				niov++;
+			}
+			from = to;
+			if (niov < IOV_MAX && j == c->nsegs)
+				break;
+			if (niov > 0 && writev_all(w->fd, iov, niov) != 0) {
+				w->err = 1;
+				return;
+			}
+			niov = 0;
+			if (j < c->nsegs)
+				copy_in(w, c->segs[j].fd, c->segs[j].offset,
+					c->segs[j].len);
+		}
+	}
+	if (niov > 0 && writev_all(w->fd, iov, niov) != 0)
+		w->err = 1;
+}
+
+/* Write the objects of doc in parallel and fill arr as write_xref expects. */
+static void
+write_objects_parallel(struct _writer *w, pag_document *doc, long *arr,
+		int threads)
+{
+	/* encoding modified streams touches the shared cache, do it here */
+	for (int i=0; i<doc->len; i++) {
+		pag_object *obj = doc->objs[i].obj;
+		if (obj != NULL && obj->type == PAG_STREAM
+		    && pag_encode_stream(obj->val.stream) != 0)
+			w->err = 1;
+	}
+
+	size_t nchunks = (doc->len + OBJS_PER_CHUNK-1) / OBJS_PER_CHUNK;
+	struct _chunk *chunks = calloc(nchunks, sizeof(struct _chunk));
+	struct _serialize_job job = {doc, chunks, w->compact};
+	pag_parallel_for(threads, nchunks, serialize_chunk, &job);
+
+	long base = w->pos;
+	for (size_t k=0; k<nchunks; k++) {
+		int first = k * OBJS_PER_CHUNK;
+		for (int i=first; i<doc->len && i<first+OBJS_PER_CHUNK; i++)
+			if (chunks[k].offs[i-first] != 0)
+				arr[i] = base + chunks[k].offs[i-first] - 1;
+		base += chunks[k].w.pos;
+	}
+
+	emit_chunks(w, chunks, nchunks);
+	w->pos = base;
+	w->last = '\n';
+
+	for (size_t k=0; k<nchunks; k++) {
+		free(chunks[k].w.buf);
+		free(chunks[k].w.segs);
+		free(chunks[k].offs);
+	}
+	free(chunks);
+}
+
+/**** linearized output ****/
+
+/* Parts of a linearized file after the header, linearization dictionary and
+first-page xref (see PDF 1.7, annex F). Pages other than the first are
+written one after the other, each page object followed by the objects only
+that page uses. */
+enum {
+	LIN_NONE,
+	LIN_CATALOG,	/* catalog and document-level objects */
+	LIN_FIRST,	/* everything the first page needs */
+	LIN_PAGES,	/* objects private to the other pages */
+	LIN_SHARED,	/* objects used by several pages */
+	LIN_OTHER	/* the rest: page tree nodes, outlines, info, ... */
+};
+
+struct _idlist {
+	unsigned int *ids;
+	size_t len;
+	size_t cap;
+};
+
+static void
+idlist_push(struct _idlist *l, unsigned int id)
+{
+	if (l->len == l->cap) {
+		l->cap = l->cap ? 2*l->cap : 64;
+		l->ids = realloc(l->ids, l->cap * sizeof(unsigned int));
+	}
+	l->ids[l->len++] = id;
+}
+
+static void
+push_ref_id(pag_ref *ref, void *arg)
+{
+	idlist_push(arg, ref->id);
+}
+
+struct _lin {
+	pag_document *doc;
+	unsigned int catalog;
+	struct _idlist pages; /* page object ids, in order */
+	char *part; /* part of each object */
+	int *user; /* index+1 of the only page using the object, -1 if several */
+	struct _idlist visits; /* objects reached from each page, in order */
+	size_t *firstvisit; /* page i reached visits[firstvisit[i] ...] */
+	struct _idlist stack;
+	struct _idlist children;
+};
+
+static int
+lin_valid(struct _lin *l, unsigned int id)
+{
+	return id >= 1 && id <= (unsigned)l->doc->len
+		&& l->doc->objs[id-1].obj != NULL;
+}
+
+/* Depth-first walk from id, calling fn on each object reached once, in
+preorder. fn returns nonzero to not go further down. */
+static void
+lin_walk(struct _lin *l, unsigned int id, unsigned int *stamp,
+		unsigned int mark, int (*fn)(struct _lin *, unsigned int, void *),
+		void *arg)
+{
+	l->stack.len = 0;
+	idlist_push(&l->stack, id);
+	while (l->stack.len > 0) {
+		id = l->stack.ids[--l->stack.len];
+		if (!lin_valid(l, id) || stamp[id] == mark)
+			continue;
+		stamp[id] = mark;
+		if (fn(l, id, arg))
+			continue;
+		l->children.len = 0;
+		pag_for_each_ref(l->doc->objs[id-1].obj, push_ref_id,
+			&l->children);
+		while (l->children.len > 0)
+			idlist_push(&l->stack,
+				l->children.ids[--l->children.len]);
+	}
+}
+
+/* Collect the pages in order, and mark page tree nodes. */
+static int
+visit_tree(struct _lin *l, unsigned int id, void *arg)
+{
+	(void)arg;
+	pag_dict *dict = pag_obj2dict(l->doc->objs[id-1].obj);
+	if (dict == NULL)
+		return 1;
+	pag_object *kids = pag_dict_get(dict, pag_make_name("Kids"));
+	if (kids == NULL || kids->type != PAG_ARRAY) {
+		idlist_push(&l->pages, id);
+		return 1;
+	}
+	l->part[id] = LIN_OTHER;
+	l->children.len = 0;
+	pag_for_each_ref(kids, push_ref_id, &l->children);
+	while (l->children.len > 0)
+		idlist_push(&l->stack, l->children.ids[--l->children.len]);
+	return 1;
+}
+
+/* Record that page *arg uses object id. Other pages, the page tree and the
+catalog are not part of a page. Page objects start as their own users. */
+static int
+visit_page(struct _lin *l, unsigned int id, void *arg)
+{
+	int page = *(int *)arg;
+	int user = l->user[id];
+	if (id == l->catalog || l->part[id] == LIN_OTHER
+	    || (user > 0 && user != page+1 && l->pages.ids[user-1] == id))
+		return 1;
+	if (user == 0)
+		l->user[id] = page+1;
+	else if (user != page+1)
+		l->user[id] = -1;
+	idlist_push(&l->visits, id);
+	return 0;
+}
+
+static int
+visit_catalog(struct _lin *l, unsigned int id, void *arg)
+{
+	(void)arg;
+	if (l->part[id] != LIN_NONE || l->user[id] != 0)
+		return 1;
+	l->part[id] = LIN_CATALOG;
 	return 0;
-}
\ No newline at end of file
+}
+
+/* Where things go once the objects are numbered in file order. The main
+xref section, ids 1 to main-1, holds the pages after the first, then the
+shared objects, then the rest. The first-page section starts at id main
+with the linearization dictionary, the catalog part, the hint stream and
+the first page, up to id n. */
+struct _linplan {
+	unsigned int n;
+	unsigned int main;
+	unsigned int hint;
+	unsigned int first; /* id of the first page object */
+	unsigned int shared;
+	unsigned int nshared;
+	unsigned int npages;
+	unsigned int *pagestart; /* id of each page object */
+	unsigned int *nobjs; /* number of objects in the group of each page */
+	struct _idlist refs; /* shared-table entries each page uses */
+	size_t *firstref; /* page i uses refs.ids[firstref[i]..firstref[i+1]] */
+	unsigned int *newid; /* id of each object in the linearized file */
+};
+
+static void
+free_linplan(struct _linplan *p)
+{
+	free(p->pagestart);
+	free(p->nobjs);
+	free(p->refs.ids);
+	free(p->firstref);
+	free(p->newid);
+}
+
+static void
+free_lin(struct _lin *l)
+{
+	free(l->part);
+	free(l->user);
+	free(l->visits.ids);
+	free(l->firstvisit);
+	free(l->stack.ids);
+	free(l->children.ids);
+	free(l->pages.ids);
+}
+
+/* Sort the objects into parts and compute their ids in the linearized
+file. Return -1 if the document has no pages to linearize. */
+static int
+plan_linearized(pag_document *doc, struct _linplan *p)
+{
+	unsigned int len = doc->len;
+	struct _lin l = {.doc=doc};
+	l.part = calloc(len+1, 1);
+	l.user = calloc(len+1, sizeof(int));
+	unsigned int *stamp = calloc(len+1, sizeof(unsigned int));
+
+	pag_ref *root = pag_get_root(doc);
+	l.catalog = root != NULL ? root->id : 0;
+	pag_dict *catalog = lin_valid(&l, l.catalog)
+		? pag_obj2dict(doc->objs[l.catalog-1].obj) : NULL;
+	pag_ref *pages = catalog == NULL ? NULL
+		: pag_obj2ref(pag_dict_get(catalog, pag_make_name("Pages")));
+	if (pages != NULL)
+		lin_walk(&l, pages->id, stamp, 1, visit_tree, NULL);
+	if (l.pages.len == 0) {
+		free_lin(&l);
+		free(stamp);
+		return -1;
+	}
+
+	unsigned int npages = l.pages.len;
+	for (unsigned int i=0; i<npages; i++)
+		l.user[l.pages.ids[i]] = i+1;
+	l.firstvisit = malloc((npages+1) * sizeof(size_t));
+	for (unsigned int i=0; i<npages; i++) {
+		int page = i;
+		l.firstvisit[i] = l.visits.len;
+		lin_walk(&l, l.pages.ids[i], stamp, 3+i, visit_page, &page);
+	}
+	l.firstvisit[npages] = l.visits.len;
+
+	l.part[l.catalog] = LIN_CATALOG;
+	char *keys[] = {"ViewerPreferences", "PageMode", "Threads",
+		"OpenAction", "AcroForm"};
+	struct _idlist roots = {0};
+	for (size_t i=0; i<sizeof(keys)/sizeof(keys[0]); i++)
+		pag_for_each_ref(pag_dict_get(catalog, pag_make_name(keys[i])),
+			push_ref_id, &roots);
+	for (size_t i=0; i<roots.len; i++)
+		lin_walk(&l, roots.ids[i], stamp, 2, visit_catalog, NULL);
+	free(roots.ids);
+	free(stamp);
+
+	unsigned int *v = l.visits.ids;
+	size_t *fv = l.firstvisit;
+	for (size_t j=fv[0]; j<fv[1]; j++)
+		l.part[v[j]] = LIN_FIRST;
+	for (size_t j=fv[1]; j<fv[npages]; j++)
+		if (l.part[v[j]] == LIN_NONE)
+			l.part[v[j]] = l.user[v[j]] < 0 ? LIN_SHARED : LIN_PAGES;
+
+	unsigned int *newid = calloc(len+1, sizeof(unsigned int));
+	unsigned int n = 0;
+	p->npages = npages;
+	p->pagestart = calloc(npages, sizeof(unsigned int));
+	p->nobjs = calloc(npages, sizeof(unsigned int));
+	for (unsigned int i=1; i<npages; i++) {
+		p->pagestart[i] = n+1;
+		for (size_t j=fv[i]; j<fv[i+1]; j++) {
+			if (l.part[v[j]] != LIN_PAGES || newid[v[j]] != 0)
+				continue;
+			newid[v[j]] = ++n;
+			p->nobjs[i]++;
+		}
+	}
+	p->shared = n+1;
+	for (size_t j=fv[1]; j<fv[npages]; j++)
+		if (l.part[v[j]] == LIN_SHARED && newid[v[j]] == 0)
+			newid[v[j]] = ++n;
+	p->nshared = n+1 - p->shared;
+	for (unsigned int id=1; id<=len; id++)
+		if (lin_valid(&l, id) && newid[id] == 0
+		    && l.part[id] != LIN_CATALOG && l.part[id] != LIN_FIRST)
+			newid[id] = ++n;
+
+	p->main = ++n; /* linearization dictionary */
+	newid[l.catalog] = ++n;
+	for (unsigned int id=1; id<=len; id++)
+		if (l.part[id] == LIN_CATALOG && newid[id] == 0)
+			newid[id] = ++n;
+	p->hint = ++n;
+	p->first = n+1;
+	for (size_t j=fv[0]; j<fv[1]; j++)
+		newid[v[j]] = ++n;
+	p->pagestart[0] = p->first;
+	p->nobjs[0] = n+1 - p->first;
+	p->n = n;
+
+	/* shared-table entries are the first-page objects, then the shared
+	part */
+	p->refs = (struct _idlist){0};
+	p->firstref = malloc((npages+1) * sizeof(size_t));
+	for (unsigned int i=0; i<npages; i++) {
+		p->firstref[i] = p->refs.len;
+		for (size_t j=fv[i]; j<fv[i+1]; j++) {
+			if (l.user[v[j]] >= 0)
+				continue;
+			unsigned int id = newid[v[j]];
+			idlist_push(&p->refs, id >= p->first ? id - p->first
+				: p->nobjs[0] + id - p->shared);
+		}
+	}
+	p->firstref[npages] = p->refs.len;
+
+	p->newid = newid;
+	free_lin(&l);
+	return 0;
+}
+
+/* Objects are moved to their linearized ids only while they are written,
+after which the caller gets its document back with the original ids,
+generations and dirty state. */
+struct _numbering {
+	unsigned int len;
+	unsigned int *gen;
+	char *dirty;
+};
+
+static void
+save_numbering(pag_document *doc, struct _numbering *s)
+{
+	s->len = doc->len;
+	s->gen = calloc(s->len+1, sizeof(unsigned int));
+	for (unsigned int id=1; id<=s->len; id++)
+		s->gen[id] = doc->objs[id-1].gen;
+	s->dirty = NULL;
+	if (doc->dirty != NULL) {
+		s->dirty = malloc(s->len+1);
+		memcpy(s->dirty, doc->dirty, s->len+1);
+	}
+}
+
+static void
+restore_gen(pag_ref *ref, void *arg)
+{
+	struct _numbering *s = arg;
+	if (ref->id >= 1 && ref->id <= s->len)
+		ref->gen = s->gen[ref->id];
+}
+
+static void
+restore_numbering(pag_document *doc, struct _linplan *p, struct _numbering *s)
+{
+	unsigned int *oldid = calloc(p->n+1, sizeof(unsigned int));
+	for (unsigned int id=1; id<=s->len; id++)
+		if (p->newid[id] != 0)
+			oldid[p->newid[id]] = id;
+	pag_apply_numbering(doc, oldid, s->len);
+	free(oldid);
+
+	for (unsigned int id=1; id<=s->len; id++) {
+		doc->objs[id-1].gen = s->gen[id];
+		pag_for_each_ref(doc->objs[id-1].obj, restore_gen, s);
+	}
+	for (pag_array *t = doc->trailer_dicts; t != NULL; t = t->next)
+		pag_for_each_ref(t->val, restore_gen, s);
+	if (s->dirty != NULL) {
+		memcpy(doc->dirty, s->dirty, s->len+1);
+	} else {
+		free(doc->dirty);
+		doc->dirty = NULL;
+	}
+	free(s->gen);
+	free(s->dirty);
+}
+
+/* Bits are written most significant first. Hint table items start on a
+byte boundary. */
+struct _bits {
+	struct _writer *w;
+	int used; /* bits used in the last byte */
+};
+
+static void
+put_bits(struct _bits *b, unsigned long v, int n)
+{
+	for (int i=n-1; i>=0; i--) {
+		if (b->used == 0) {
+			*reserve(b->w, 1) = 0;
+			b->w->len++;
+			b->w->pos++;
+		}
+		if (v >> i & 1)
+			b->w->buf[b->w->len-1] |= 0x80 >> b->used;
+		b->used = (b->used + 1) % 8;
+	}
+}
+
+static void
+align_bits(struct _bits *b)
+{
+	b->used = 0;
+}
+
+static int
+nbits(unsigned long v)
+{
+	int n = 0;
+	for (; v > 0; v >>= 1)
+		n++;
+	return n;
+}
+
+/* Build the primary hint stream: the page offset hint table, then the shared
+object hint table. Offsets are given as if the hint stream were not there,
+so h is where the hint stream starts and off[id] the position of the
+objects after it relative to h. */
+static pag_stream *
+make_hint_stream(struct _linplan *p, long *off, long *objlen, long h)
+{
+	struct _writer data;
+	init_writer(&data, -1);
+	struct _bits b = {&data, 0};
+
+	unsigned int npages = p->npages;
+	long *pagelen = calloc(npages, sizeof(long));
+	unsigned long minobjs = ~0UL, maxobjs = 0, minlen = ~0UL, maxlen = 0;
+	unsigned long maxrefs = 0, maxid = 0;
+	for (unsigned int i=0; i<npages; i++) {
+		for (unsigned int k=0; k<p->nobjs[i]; k++)
+			pagelen[i] += objlen[p->pagestart[i]+k];
+		unsigned long nobjs = p->nobjs[i], len = pagelen[i];
+		unsigned long nrefs = p->firstref[i+1] - p->firstref[i];
+		minobjs = nobjs < minobjs ? nobjs : minobjs;
+		maxobjs = nobjs > maxobjs ? nobjs : maxobjs;
+		minlen = len < minlen ? len : minlen;
+		maxlen = len > maxlen ? len : maxlen;
+		maxrefs = nrefs > maxrefs ? nrefs : maxrefs;
+	}
+	for (size_t j=0; j<p->refs.len; j++)
+		if (p->refs.ids[j] > maxid)
+			maxid = p->refs.ids[j];
+	int bobjs = nbits(maxobjs - minobjs), blen = nbits(maxlen - minlen);
+	int brefs = nbits(maxrefs), bid = nbits(maxid);
+
+	/* content streams are not located, a page is taken as a whole */
+	put_bits(&b, minobjs, 32);
+	put_bits(&b, h + off[p->first], 32);
+	put_bits(&b, bobjs, 16);
+	put_bits(&b, minlen, 32);
+	put_bits(&b, blen, 16);
+	put_bits(&b, 0, 32); /* least offset of a content stream */
+	put_bits(&b, 0, 16);
+	put_bits(&b, minlen, 32); /* least length of a content stream */
+	put_bits(&b, blen, 16);
+	put_bits(&b, brefs, 16);
+	put_bits(&b, bid, 16);
+	put_bits(&b, 0, 16); /* fractional positions are not given */
+	put_bits(&b, 4, 16);
+	align_bits(&b);
+
+	for (unsigned int i=0; i<npages; i++)
+		put_bits(&b, p->nobjs[i] - minobjs, bobjs);
+	align_bits(&b);
+	for (unsigned int i=0; i<npages; i++)
+		put_bits(&b, pagelen[i] - minlen, blen);
+	align_bits(&b);
+	for (unsigned int i=0; i<npages; i++)
+		put_bits(&b, p->firstref[i+1] - p->firstref[i], brefs);
+	align_bits(&b);
+	for (size_t j=0; j<p->refs.len; j++)
+		put_bits(&b, p->refs.ids[j], bid);
+	align_bits(&b);
+	/* numerators take no bits, content stream offsets neither */
+	for (unsigned int i=0; i<npages; i++)
+		put_bits(&b, pagelen[i] - minlen, blen);
+	align_bits(&b);
+	free(pagelen);
+
+	long s = data.len;
+	unsigned int nfirst = p->nobjs[0];
+	unsigned int total = nfirst + p->nshared;
+	unsigned long mingroup = ~0UL, maxgroup = 0;
+	for (unsigned int k=0; k<total; k++) {
+		unsigned int id = k < nfirst ? p->first+k : p->shared+k-nfirst;
+		unsigned long len = objlen[id];
+		mingroup = len < mingroup ? len : mingroup;
+		maxgroup = len > maxgroup ? len : maxgroup;
+	}
+	int bgroup = nbits(maxgroup - mingroup);
+	put_bits(&b, p->nshared > 0 ? p->shared : 0, 32);
+	put_bits(&b, p->nshared > 0 ? h + off[p->shared] : 0, 32);
+	put_bits(&b, nfirst, 32);
+	put_bits(&b, total, 32);
+	put_bits(&b, 0, 16); /* one object per group */
+	put_bits(&b, mingroup, 32);
+	put_bits(&b, bgroup, 16);
+	align_bits(&b);
+	for (unsigned int k=0; k<total; k++) {
+		unsigned int id = k < nfirst ? p->first+k : p->shared+k-nfirst;
+		put_bits(&b, objlen[id] - mingroup, bgroup);
+	}
+	align_bits(&b);
+	for (unsigned int k=0; k<total; k++)
+		put_bits(&b, 0, 1); /* no MD5 signatures */
+	align_bits(&b);
+
+	pag_dict *dict = pag_make_empty_dict();
+	pag_dict_set(dict, pag_make_name("S"), pag_int2obj(pag_make_int(s)));
+	pag_dict_set(dict, pag_make_name("Length"),
+		pag_int2obj(pag_make_int(data.len)));
+	return pag_make_stream(dict, data.buf);
+}
+
+enum {LIN_L, LIN_H, LIN_HL, LIN_E, LIN_T, LIN_X, LIN_NVALUES};
+
+/* Write the linearization dictionary, whose length goes in *linlen, and the
+first-page xref section and trailer. pos[id] is the offset of each object
+of the first-page section. */
+static void
+write_lin_prefix(struct _writer *w, pag_document *doc, struct _linplan *p,
+		long *pos, long *values, long *linlen)
+{
+	long start = w->pos;
+	put_uint(w, p->main, 1);
+	puts_w(w, " 0 obj\n<< /Linearized 1 /L ");
+	put_uint(w, values[LIN_L], 1);
+	puts_w(w, " /H [ ");
+	put_uint(w, values[LIN_H], 1);
+	putc_w(w, ' ');
+	put_uint(w, values[LIN_HL], 1);
+	puts_w(w, " ] /O ");
+	put_uint(w, p->first, 1);
+	puts_w(w, " /E ");
+	put_uint(w, values[LIN_E], 1);
+	puts_w(w, " /N ");
+	put_uint(w, p->npages, 1);
+	puts_w(w, " /T ");
+	put_uint(w, values[LIN_T], 1);
+	puts_w(w, " >>\nendobj\n");
+	*linlen = w->pos - start;
+
+	puts_w(w, "xref\n");
+	put_uint(w, p->main, 1);
+	putc_w(w, ' ');
+	put_uint(w, p->n - p->main + 1, 1);
+	putc_w(w, '\n');
+	for (unsigned int id=p->main; id<=p->n; id++) {
+		put_uint(w, pos[id], 10);
+		puts_w(w, " 00000 n \n");
+	}
+
+	pag_dict *trailer = make_trailer(doc->trailer_dicts->val->val.dict,
+		p->n+1);
+	pag_dict_set(trailer, pag_make_name("Prev"),
+		pag_int2obj(pag_make_int(values[LIN_X])));
+	write_trailer(w, 0, pag_dict2obj(trailer));
+}
+
+/* Serialize objects from to to, recording where each starts in w and its
+length. */
+static void
+lin_serialize(struct _writer *w, pag_document *doc, unsigned int from,
+		unsigned int to, long *off, long *objlen)
+{
+	for (unsigned int id=from; id<=to; id++) {
+		off[id] = w->pos;
+		write_indirect_obj(w, doc->objs[id-1]);
+		objlen[id] = w->pos - off[id];
+	}
+}
+
+static void
+free_chunk(struct _chunk *c)
+{
+	free(c->w.buf);
+	free(c->w.segs);
+}
+
+/* Objects are serialized first, then the positions that go in the
+linearization dictionary and the first-page xref are computed again until
+the size of these settles; it can only grow. Return -1 if the document
+cannot be linearized, which encrypted documents cannot as their ids are
+part of the encryption keys. */
+static int
+write_linearized(struct _writer *w, pag_document *doc)
+{
+	struct _linplan p;
+	if (pag_is_encrypted(doc) || plan_linearized(doc, &p) != 0)
+		return -1;
+	unsigned int n = p.n;
+	struct _numbering saved;
+	save_numbering(doc, &saved);
+	pag_apply_numbering(doc, p.newid, n);
+
+	write_pdf_version(w, doc->version);
+	long p0 = w->pos;
+
+	/* parts[0] is the catalog part, parts[1] the first page followed by
+	the main section */
+	struct _chunk parts[2];
+	for (int k=0; k<2; k++) {
+		init_writer(&parts[k].w, -1);
+		parts[k].w.compact = w->compact;
+		parts[k].w.defer = 1;
+	}
+	long *off = calloc(n+1, sizeof(long));
+	long *objlen = calloc(n+1, sizeof(long));
+	lin_serialize(&parts[0].w, doc, p.main+1, p.hint-1, off, objlen);
+	lin_serialize(&parts[1].w, doc, p.first, n, off, objlen);
+	lin_serialize(&parts[1].w, doc, 1, p.main-1, off, objlen);
+	long endfirst = off[n] + objlen[n];
+
+	struct _writer hw, pw, mw;
+	init_writer(&hw, -1);
+	init_writer(&pw, -1);
+	init_writer(&mw, -1);
+	hw.compact = w->compact;
+	pag_stream *hint = make_hint_stream(&p, off, objlen, 0);
+	pag_object *hintobj = pag_stream2obj(hint);
+	write_indirect_obj(&hw, pag_make_ref(p.hint, 0, hintobj));
+	long hl = hw.pos;
+	free(hint->stream);
+	pag_free_object(hintobj);
+
+	long *pos = calloc(n+1, sizeof(long));
+	long *mainpos = calloc(p.main, sizeof(long));
+	long values[LIN_NVALUES];
+	long pre = 0, linlen = 0, h = 0;
+	int digits = 0;
+	for (unsigned int v=p.main; v > 0; v /= 10)
+		digits++;
+	for (;;) {
+		long a = p0 + pre, r, x;
+		h = a + parts[0].w.pos;
+		r = h + hl;
+		x = r + parts[1].w.pos;
+		pos[p.main] = p0;
+		for (unsigned int id=p.main+1; id<p.hint; id++)
+			pos[id] = a + off[id];
+		pos[p.hint] = h;
+		for (unsigned int id=p.first; id<=n; id++)
+			pos[id] = r + off[id];
+		for (unsigned int id=1; id<p.main; id++)
+			mainpos[id-1] = r + off[id];
+
+		/* main xref and trailer, pointing back to the first-page xref */
+		mw.len = mw.pos = 0;
+		write_xref(&mw, mainpos, p.main-1);
+		pag_dict *trailer = pag_make_empty_dict();
+		pag_dict_set(trailer, pag_make_name("Size"),
+			pag_int2obj(pag_make_int(p.main)));
+		write_trailer(&mw, p0 + linlen, pag_dict2obj(trailer));
+
+		values[LIN_L] = x + mw.pos;
+		values[LIN_H] = h;
+		values[LIN_HL] = hl;
+		values[LIN_E] = r + endfirst;
+		/* the end of line before the first entry, after "xref\n0 N" */
+		values[LIN_T] = x + 7 + digits;
+		values[LIN_X] = x;
+
+		long newlen;
+		pw.len = pw.pos = 0;
+		write_lin_prefix(&pw, doc, &p, pos, values, &newlen);
+		if (pw.pos == pre && newlen == linlen)
+			break;
+		pre = pw.pos;
+		linlen = newlen;
+	}
+
+	hw.len = hw.pos = 0;
+	hint = make_hint_stream(&p, off, objlen, h);
+	hintobj = pag_stream2obj(hint);
+	write_indirect_obj(&hw, pag_make_ref(p.hint, 0, hintobj));
+	free(hint->stream);
+	pag_free_object(hintobj);
+
+	put(w, pw.buf, pw.len);
+	emit_chunks(w, &parts[0], 1);
+	w->pos += parts[0].w.pos;
+	put(w, hw.buf, hw.len);
+	emit_chunks(w, &parts[1], 1);
+	w->pos += parts[1].w.pos;
+	put(w, mw.buf, mw.len);
+
+	free_chunk(&parts[0]);
+	free_chunk(&parts[1]);
+	free(hw.buf);
+	free(pw.buf);
+	free(mw.buf);
+	free(off);
+	free(objlen);
+	free(pos);
+	free(mainpos);
+	restore_numbering(doc, &p, &saved);
+	free_linplan(&p);
+	return 0;
+}
+
+pag_write_options
+pag_make_write_options(void)
+{
+	pag_write_options opts = {.compress=0, .threads=0, .dedup=0,
+		.gc=0, .renumber=0, .compact=0, .objstm=0,
+		.linearize=0};
+	return opts;
+}
+
+/**** sinks ****/
+
+pag_sink *
+pag_make_memory_sink(void)
+{
+	pag_sink *sink = calloc(1, sizeof(pag_sink));
+	sink->fd = -1;
+	return sink;
+}
+
+pag_sink *
+pag_make_fd_sink(int fd)
+{
+	pag_sink *sink = pag_make_memory_sink();
+	sink->fd = fd;
+	return sink;
+}
+
+pag_sink *
+pag_make_callback_sink(int (*fn)(void *arg, const char *buf, size_t len),
+		void *arg)
+{
+	pag_sink *sink = pag_make_memory_sink();
+	sink->fn = fn;
+	sink->arg = arg;
+	return sink;
+}
+
+char *
+pag_sink_data(pag_sink *sink, size_t *len)
+{
+	*len = sink->len;
+	return sink->buf;
+}
+
+void
+pag_free_sink(pag_sink *sink)
+{
+	free(sink->buf);
+	free(sink);
+}
+
+/* A memory sink lends its buffer to the writer, which appends to it. */
+static void
+init_sink_writer(struct _writer *w, pag_sink *sink)
+{
+	init_writer(w, sink->fd);
+	w->fn = sink->fn;
+	w->arg = sink->arg;
+	if (sink->fd < 0 && sink->fn == NULL && sink->buf != NULL) {
+		free(w->buf);
+		w->buf = sink->buf;
+		w->len = w->pos = sink->len;
+		w->cap = sink->cap;
+	}
+}
+
+static int
+finish_sink_writer(struct _writer *w, pag_sink *sink)
+{
+	flush(w);
+	if (sink->fd < 0 && sink->fn == NULL) {
+		sink->buf = w->buf;
+		sink->len = w->len;
+		sink->cap = w->cap;
+	} else {
+		free(w->buf);
+	}
+	return w->err ? -1 : 0;
+}
+
+char *
+pag_obj2cstring(pag_object *obj)
+{
+	struct _writer w;
+	init_writer(&w, -1);
+	w.compact = 1;
+	write_obj_compact(&w, obj);
+	putc_w(&w, 0);
+	if (w.err) {
+		free(w.buf);
+		return NULL;
+	}
+	return w.buf;
+}
+
+int
+pag_write_document(pag_document *doc, FILE *file, pag_write_options *opts)
+{
+	pag_sink sink = {.fd=fileno(file)};
+	fflush(file);
+	int ret = pag_write_to_sink(doc, &sink, opts);
+
+	/* stdio caches the file position, resynchronize it */
+	off_t pos = lseek(sink.fd, 0, SEEK_CUR);
+	if (pos >= 0)
+		fseek(file, pos, SEEK_SET);
+	return ret;
+}
+
+int
+pag_write_to_sink(pag_document *doc, pag_sink *sink, pag_write_options *opts)
+{
+	pag_write_options defaults = pag_make_write_options();
+	if (opts == NULL)
+		opts = &defaults;
+	if (pag_load_all(doc) < 0)
+		return -1;
+
+	if (opts->dedup)
+		pag_dedup_streams(doc);
+	if (opts->gc)
+		pag_collect_garbage(doc);
+	if (opts->renumber && !pag_is_encrypted(doc))
+		pag_renumber_objects(doc);
+	if (opts->compress > 0
+	    && pag_compress_streams(doc, opts->compress, opts->threads) != 0)
+		return -1;
+
+	struct _writer w;
+	init_sink_writer(&w, sink);
+	w.compact = opts->compact;
+
+	if (opts->linearize && write_linearized(&w, doc) == 0)
+		goto end;
+
+	/* objects in object streams would escape encryption */
+	if (opts->objstm > 0 && !pag_is_encrypted(doc)) {
+		write_pdf_version(&w, doc->version < 15 ? 15 : doc->version);
+		write_compressed(&w, doc, opts->objstm);
+		goto end;
+	}
+
+	write_pdf_version(&w, doc->version);
+
+	long *arr = calloc(doc->len, sizeof(long));
+	int threads = pag_nb_threads(opts->threads);
+	if (threads > 1 && doc->len > OBJS_PER_CHUNK) {
+		write_objects_parallel(&w, doc, arr, threads);
+	} else {
+		for (int i=0; i < doc->len; i++) {
+			if (doc->objs[i].obj == NULL)
+				continue; /* free */
+			arr[i] = w.pos;
+			write_indirect_obj(&w, doc->objs[i]);
+		}
+	}
+
+	long startxref = w.pos;
+	write_xref(&w, arr, doc->len);
+	pag_dict *trailer = doc->trailer_dicts->val->val.dict;
+	write_trailer(&w, startxref,
+		pag_dict2obj(make_trailer(trailer, doc->len+1)));
+	free(arr);
+
+end:
+	return finish_sink_writer(&w, sink);
+}
+
+/* Write the xref section of an incremental update: one subsection per run of
+modified objects. arr[id] is the offset of object id, or 0 if it was
+freed. */
+static void
+write_xref_update(struct _writer *w, pag_document *doc, long *arr)
+{
+	puts_w(w, "xref\n");
+	for (int id=1; id <= doc->len; ) {
+		if (!doc->dirty[id]) {
+			id++;
+			continue;
+		}
+		int end = id;
+		while (end <= doc->len && doc->dirty[end])
+			end++;
+		put_uint(w, id, 1);
+		putc_w(w, ' ');
+		put_uint(w, end-id, 1);
+		putc_w(w, '\n');
+		for (; id < end; id++) {
+			if (arr[id] != 0) {
+				put_uint(w, arr[id], 10);
+				putc_w(w, ' ');
+				put_uint(w, doc->objs[id-1].gen, 5);
+				puts_w(w, " n \n");
+			} else {
+				put_uint(w, 0, 10);
+				putc_w(w, ' ');
+				put_uint(w, doc->table.table[id].gen+1, 5);
+				puts_w(w, " f \n");
+			}
+		}
+	}
+}
+
+int
+pag_write_incremental(pag_document *doc, FILE *file, pag_write_options *opts)
+{
+	pag_write_options defaults = pag_make_write_options();
+	if (opts == NULL)
+		opts = &defaults;
+	if (doc->dirty == NULL || doc->fd < 0)
+		return -1;
+
+	/* dedup and object streams rewrite the whole file, they do not apply */
+	if (opts->compress > 0
+	    && pag_compress_streams(doc, opts->compress, opts->threads) != 0)
+		return -1;
+
+	struct stat in, out;
+	fflush(file);
+	if (fstat(doc->fd, &in) != 0 || fstat(fileno(file), &out) != 0)
+		return -1;
+	int inplace = in.st_dev == out.st_dev && in.st_ino == out.st_ino;
+
+	struct _writer w;
+	init_writer(&w, fileno(file));
+	w.compact = opts->compact;
+
+	long base = w.pos;
+	if (inplace) {
+		base = 0;
+		w.pos = lseek(w.fd, 0, SEEK_END);
+	} else if (copy_range(doc->fd, 0, w.fd, in.st_size) != 0) {
+		w.err = 1;
+	} else {
+		w.pos += in.st_size;
+	}
+	base += doc->start_offset;
+
+	long startxref = doc->startxref;
+	int ndirty = 0;
+	for (int id=1; id <= doc->len; id++)
+		ndirty += doc->dirty[id];
+	if (ndirty == 0)
+		goto end; /* nothing to append */
+
+	char last = 0;
+	if (in.st_size > 0 && pread(doc->fd, &last, 1, in.st_size-1) != 1)
+		last = 0;
+	if (last != '\n' && last != '\r')
+		putc_w(&w, '\n');
+
+	long *arr = calloc(doc->len+1, sizeof(long));
+	for (int id=1; id <= doc->len; id++) {
+		if (!doc->dirty[id] || doc->objs[id-1].obj == NULL)
+			continue;
+		arr[id] = w.pos - base;
+		write_indirect_obj(&w, doc->objs[id-1]);
+	}
+	if (w.err) {
+		free(arr);
+		goto end; /* no xref for objects that are not all there */
+	}
+
+	startxref = w.pos - base;
+	write_xref_update(&w, doc, arr);
+	free(arr);
+
+	pag_dict *trailer = doc->trailer_dicts->val->val.dict;
+	pag_dict *dict = make_trailer(trailer, doc->len+1);
+	pag_dict_set(dict, pag_make_name("Prev"),
+		pag_int2obj(pag_make_int(doc->startxref)));
+	write_trailer(&w, startxref, pag_dict2obj(dict));
+
+end:
+	flush(&w);
+	/* give the file its original bytes back rather than a broken update */
+	if (inplace && w.err && ftruncate(w.fd, in.st_size) == 0)
+		lseek(w.fd, in.st_size, SEEK_SET);
+
+	off_t pos = lseek(w.fd, 0, SEEK_CUR);
+	if (pos >= 0)
+		fseek(file, pos, SEEK_SET);
+	free(w.buf);
+
+	/* the update is now part of the input file */
+	if (inplace && ndirty > 0 && !w.err) {
+		doc->startxref = startxref;
+		memset(doc->dirty, 0, doc->len+1);
+	}
+	return w.err ? -1 : 0;
+}
+
+
+/**** merged output ****/
+
+/* Inputs are parsed a window at a time, each on its own thread, and their
+objects serialized in memory under ids that follow those of the inputs
+before them. The window is then emitted and freed. The page tree root of
+each input becomes a kid of a new root, written with the catalog last. */
+
+#define MERGE_WINDOW_PER_THREAD 2
+#define MERGE_CATALOG 1
+#define MERGE_PAGES 2
+
+struct _merge_input {
+	char *path;
+	FILE *file;
+	pag_document *doc;
+	unsigned int root; /* page tree root, 0 if the input is unusable */
+	long count; /* pages under it */
+	struct _idlist order; /* objects reached from root, in preorder */
+	unsigned int *newid;
+	unsigned int base; /* new ids are base+1 ... base+order.len */
+	struct _chunk chunk;
+};
+
+struct _merge_job {
+	struct _merge_input *inputs;
+	int compact;
+};
+
+/* Get the page tree root of an input, NULL if it has none or cannot be
+merged. */
+static pag_ref *
+merge_root(pag_document *doc)
+{
+	/* encrypted strings depend on the object id */
+	if (pag_is_encrypted(doc))
+		return NULL;
+	pag_ref *ref = pag_get_root(doc);
+	pag_dict *catalog = ref != NULL
+		? pag_obj2dict(pag_get_indirect_obj(doc, *ref)) : NULL;
+	ref = catalog != NULL
+		? pag_obj2ref(pag_dict_get(catalog, pag_make_name("Pages")))
+		: NULL;
+	pag_dict *root = ref != NULL
+		? pag_obj2dict(pag_get_indirect_obj(doc, *ref)) : NULL;
+	return root != NULL ? ref : NULL;
+}
+
+struct _merge_check {
+	char **paths;
+	char *ok;
+};
+
+/* Open an input lazily, reading only its xref sections, catalog and page
+tree root, to find whether it can be merged. */
+static void
+check_input(void *arg, size_t k)
+{
+	struct _merge_check *c = arg;
+	FILE *file = fopen(c->paths[k], "rb");
+	pag_document *doc = file != NULL ? pag_open_file(file) : NULL;
+	c->ok[k] = doc != NULL && merge_root(doc) != NULL;
+	pag_free_document(doc);
+	if (file != NULL)
+		fclose(file);
+}
+
+/* Read an input and number its objects in a walk from its page tree root,
+which leaves out the catalog and what only it uses. */
+static void
+parse_input(void *arg, size_t k)
+{
+	struct _merge_input *in = &((struct _merge_job *)arg)->inputs[k];
+	in->file = fopen(in->path, "rb");
+	in->doc = in->file != NULL ? pag_parse_file(in->file) : NULL;
+	pag_document *doc = in->doc;
+	if (doc == NULL)
+		return;
+
+	pag_ref *ref = merge_root(doc);
+	if (ref == NULL)
+		return;
+	in->root = ref->id;
+	pag_dict *root = pag_obj2dict(pag_get_indirect_obj(doc, *ref));
+	pag_object *count = pag_dict_get(root, pag_make_name("Count"));
+	in->count = count != NULL && count->type == PAG_INT
+		? count->val.intv.val : 0;
+
+	unsigned int len = doc->len;
+	in->newid = calloc(len+1, sizeof(unsigned int));
+	struct _idlist stack = {0}, children = {0};
+	idlist_push(&stack, in->root);
+	while (stack.len > 0) {
+		unsigned int id = stack.ids[--stack.len];
+		if (id < 1 || id > len || in->newid[id] != 0
+		    || doc->objs[id-1].obj == NULL)
+			continue;
+		idlist_push(&in->order, id);
+		in->newid[id] = in->order.len;
+		children.len = 0;
+		pag_for_each_ref(doc->objs[id-1].obj, push_ref_id, &children);
+		while (children.len > 0)
+			idlist_push(&stack, children.ids[--children.len]);
+	}
+	free(stack.ids);
+	free(children.ids);
+}
+
+static void
+serialize_input(void *arg, size_t k)
+{
+	struct _merge_job *job = arg;
+	struct _merge_input *in = &job->inputs[k];
+	pag_document *doc = in->doc;
+	size_t n = in->order.len;
+
+	for (size_t i=0; i<n; i++)
+		in->newid[in->order.ids[i]] += in->base;
+	for (size_t i=0; i<n; i++)
+		pag_renumber_refs(doc->objs[in->order.ids[i]-1].obj, in->newid,
+			doc->len);
+	pag_dict_set(doc->objs[in->root-1].obj->val.dict,
+		pag_make_name("Parent"),
+		pag_ref2obj(pag_make_ref(MERGE_PAGES, 0, NULL)));
+
+	struct _chunk *c = &in->chunk;
+	init_writer(&c->w, -1);
+	c->w.compact = job->compact;
+	c->w.defer = 1;
+	c->offs = calloc(n > 0 ? n : 1, sizeof(long));
+	for (size_t i=0; i<n; i++) {
+		c->offs[i] = c->w.pos + 1;
+		write_indirect_obj(&c->w, pag_make_ref(in->base+i+1, 0,
+			doc->objs[in->order.ids[i]-1].obj));
+	}
+}
+
+static void
+free_input(struct _merge_input *in)
+{
+	pag_free_document(in->doc);
+	if (in->file != NULL)
+		fclose(in->file);
+	free(in->newid);
+	free(in->order.ids);
+	free_chunk(&in->chunk);
+	free(in->chunk.offs);
+}
+
+/* Write the new page tree root and catalog, then the xref and trailer. arr
+holds the offsets of objects 1 to len. */
+static void
+write_merge_end(struct _writer *w, long *arr, unsigned int len,
+		struct _idlist *roots, long count, int version)
+{
+	pag_array *kids = NULL, *last = NULL;
+	for (size_t i=0; i<roots->len; i++) {
+		pag_array *node = pag_make_array_single(pag_ref2obj(
+			pag_make_ref(roots->ids[i], 0, NULL)));
+		if (last == NULL)
+			kids = node;
+		else
+			last->next = node;
+		last = node;
+	}
+	pag_dict *pages = pag_make_empty_dict();
+	pag_dict_set(pages, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("Pages")));
+	pag_dict_set(pages, pag_make_name("Kids"), pag_array2obj(kids));
+	pag_dict_set(pages, pag_make_name("Count"),
+		pag_int2obj(pag_make_int(count)));
+	arr[MERGE_PAGES-1] = w->pos;
+	write_indirect_obj(w, pag_make_ref(MERGE_PAGES, 0,
+		pag_dict2obj(pages)));
+
+	pag_dict *catalog = pag_make_empty_dict();
+	pag_dict_set(catalog, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("Catalog")));
+	pag_dict_set(catalog, pag_make_name("Pages"),
+		pag_ref2obj(pag_make_ref(MERGE_PAGES, 0, NULL)));
+	/* the header was written before the later inputs were read */
+	if (version > 0) {
+		char name[] = {'0' + version/10, '.', '0' + version%10, 0};
+		pag_dict_set(catalog, pag_make_name("Version"),
+			pag_name2obj(pag_make_name(name)));
+	}
+	arr[MERGE_CATALOG-1] = w->pos;
+	write_indirect_obj(w, pag_make_ref(MERGE_CATALOG, 0,
+		pag_dict2obj(catalog)));
+
+	long startxref = w->pos;
+	write_xref(w, arr, len);
+	pag_dict *trailer = pag_make_empty_dict();
+	pag_dict_set(trailer, pag_make_name("Size"),
+		pag_int2obj(pag_make_int(len+1)));
+	pag_dict_set(trailer, pag_make_name("Root"),
+		pag_ref2obj(pag_make_ref(MERGE_CATALOG, 0, NULL)));
+	write_trailer(w, startxref, pag_dict2obj(trailer));
+}
+
+int
+pag_merge_files(char *paths[], int n, pag_sink *sink,
+		pag_write_options *opts)
+{
+	pag_write_options defaults = pag_make_write_options();
+	if (opts == NULL)
+		opts = &defaults;
+	if (n < 1)
+		return -1;
+
+	int threads = pag_nb_threads(opts->threads);
+
+	/* inputs are written as they are read, so all of them are checked
+	before the sink gets anything */
+	struct _merge_check check = {paths, malloc(n)};
+	pag_parallel_for(threads, n, check_input, &check);
+	int usable = 1;
+	for (int k=0; k<n; k++)
+		usable &= check.ok[k];
+	free(check.ok);
+	if (!usable)
+		return -1;
+
+	int window = threads * MERGE_WINDOW_PER_THREAD;
+	struct _merge_input *inputs = malloc(window * sizeof(*inputs));
+	struct _merge_job job = {inputs, opts->compact};
+
+	struct _writer w;
+	init_sink_writer(&w, sink);
+	w.compact = opts->compact;
+
+	struct _idlist roots = {0};
+	long *arr = NULL;
+	size_t cap = 0;
+	unsigned int next = MERGE_PAGES;
+	long count = 0;
+	int header = 0, version = 0, ret = 0;
+	for (int first=0; first < n && ret == 0; first += window) {
+		int m = n - first < window ? n - first : window;
+		memset(inputs, 0, m * sizeof(*inputs));
+		for (int k=0; k<m; k++)
+			inputs[k].path = paths[first+k];
+		pag_parallel_for(threads, m, parse_input, &job);
+
+		for (int k=0; k<m; k++) {
+			struct _merge_input *in = &inputs[k];
+			if (in->root == 0) {
+				ret = -1;
+				continue;
+			}
+			in->base = next;
+			next += in->order.len;
+			count += in->count;
+			if (in->doc->version > version)
+				version = in->doc->version;
+		}
+		if (ret != 0)
+			goto done;
+
+		if (header == 0) {
+			header = version;
+			write_pdf_version(&w, header);
+		}
+		pag_parallel_for(threads, m, serialize_input, &job);
+
+		if (next > cap) {
+			cap = next > 2*cap ? next : 2*cap;
+			arr = realloc(arr, cap * sizeof(long));
+		}
+		long pos = w.pos;
+		for (int k=0; k<m; k++) {
+			struct _merge_input *in = &inputs[k];
+			for (size_t i=0; i < in->order.len; i++)
+				arr[in->base + i] = pos + in->chunk.offs[i] - 1;
+			pos += in->chunk.w.pos;
+			idlist_push(&roots, in->newid[in->root]);
+			emit_chunks(&w, &in->chunk, 1);
+		}
+		w.pos = pos;
+		w.last = '\n';
+
+	done:
+		for (int k=0; k<m; k++)
+			free_input(&inputs[k]);
+	}
+
+	if (ret == 0)
+		write_merge_end(&w, arr, next, &roots, count,
+			version > header ? version : 0);
+	free(inputs);
+	free(roots.ids);
+	free(arr);
+	if (finish_sink_writer(&w, sink) != 0)
+		ret = -1;
+	return ret;
+}
+
+
+/**** split output ****/
+
+/* All outputs keep the ids of the source document, so an object is
+serialized once and its bytes are reused by every output that needs it;
+the xref sections of an output only list the objects it holds, and
+references to the others, like pages of other outputs, read as null. Each
+output gets its own catalog and page tree root, with ids past those of the
+source. */
+
+struct _split_obj {
+	size_t chunk;
+	size_t from, to; /* bytes in the chunk buffer */
+	size_t seg; /* first deferred segment in them */
+	long len; /* bytes in the output */
+	int err; /* whether it could not be serialized */
+};
+
+struct _split {
+	pag_document *doc;
+	pag_pagetree *tree;
+	unsigned int len; /* of the source; the new objects follow */
+	pag_object **pagecopy; /* page objects as written, by id */
+	unsigned int *need; /* ids held by some output, in order */
+	size_t nneed;
+	struct _split_obj *recs; /* by index in need */
+	size_t *rec; /* index in need by id */
+	struct _chunk *chunks;
+	int compact;
+	int **pages;
+	int *npages;
+	struct _idlist *ids; /* objects of each output, sorted */
+	pag_sink **sinks;
+	int *err;
+};
+
+static pag_object *
+split_obj(struct _split *s, unsigned int id)
+{
+	return s->pagecopy[id] != NULL ? s->pagecopy[id]
+		: s->doc->objs[id-1].obj;
+}
+
+/* Copy a page with its inherited attributes and the new parent. */
+static pag_object *
+copy_page(pag_page *page, unsigned int parent)
+{
+	pag_object *copy = pag_copy_object(pag_dict2obj(page->dict));
+	pag_dict *dict = copy->val.dict;
+	char *keys[] = {"Resources", "MediaBox", "CropBox", "Rotate"};
+	pag_object *attrs[] = {page->resources, page->mediabox, page->cropbox,
+		page->rotate};
+	for (size_t i=0; i<sizeof(keys)/sizeof(keys[0]); i++)
+		if (attrs[i] != NULL
+		    && pag_dict_get(dict, pag_make_name(keys[i])) == NULL)
+			pag_dict_set(dict, pag_make_name(keys[i]),
+				pag_copy_object(attrs[i]));
+	pag_dict_set(dict, pag_make_name("Parent"),
+		pag_ref2obj(pag_make_ref(parent, 0, NULL)));
+	return copy;
+}
+
+static int
+cmp_ids(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Collect the objects of output k: its pages, the objects they use, and
+those of the trailer. Pages not in the output and page tree nodes are
+left out. */
+static void
+split_closure(struct _split *s, int k, unsigned int *stamp,
+		struct _idlist *stack, struct _idlist *children)
+{
+	struct _idlist *ids = &s->ids[k];
+	stack->len = 0;
+	for (int i=0; i < s->npages[k]; i++) {
+		unsigned int id = s->tree->pages[s->pages[k][i]].id;
+		if (stamp[id] != (unsigned)k+1) {
+			stamp[id] = k+1;
+			idlist_push(stack, id);
+		}
+	}
+	pag_dict *trailer = s->doc->trailer_dicts->val->val.dict;
+	children->len = 0;
+	pag_for_each_ref(pag_dict_get(trailer, pag_make_name("Info")),
+		push_ref_id, children);
+	pag_for_each_ref(pag_dict_get(trailer, pag_make_name("Encrypt")),
+		push_ref_id, children);
+
+	for (;;) {
+		for (size_t i=0; i < children->len; i++) {
+			unsigned int kid = children->ids[i];
+			if (kid < 1 || kid > s->len || stamp[kid] == (unsigned)k+1)
+				continue;
+			stamp[kid] = k+1;
+			pag_object *obj = pag_get_indirect_obj(s->doc,
+				pag_make_ref(kid, 0, NULL));
+			if (obj != NULL && !pag_is_page_node(obj))
+				idlist_push(stack, kid);
+		}
+		if (stack->len == 0)
+			break;
+		unsigned int id = stack->ids[--stack->len];
+		idlist_push(ids, id);
+		children->len = 0;
+		pag_for_each_ref(split_obj(s, id), push_ref_id, children);
+	}
+	qsort(ids->ids, ids->len, sizeof(unsigned int), cmp_ids);
+}
+
+static void
+serialize_split_chunk(void *arg, size_t k)
+{
+	struct _split *s = arg;
+	struct _chunk *c = &s->chunks[k];
+	init_writer(&c->w, -1);
+	c->w.compact = s->compact;
+	c->w.defer = 1;
+	for (size_t i = k*OBJS_PER_CHUNK; i < s->nneed
+	    && i < (k+1)*OBJS_PER_CHUNK; i++) {
+		unsigned int id = s->need[i];
+		struct _split_obj *r = &s->recs[i];
+		long pos = c->w.pos;
+		r->chunk = k;
+		r->from = c->w.len;
+		r->seg = c->w.nsegs;
+		write_indirect_obj(&c->w, pag_make_ref(id,
+			s->doc->objs[id-1].gen, split_obj(s, id)));
+		r->to = c->w.len;
+		r->len = c->w.pos - pos;
+		r->err = c->w.err;
+		c->w.err = 0;
+	}
+}
+
+/* Send the bytes of a serialized object to w. */
+static void
+emit_split_obj(struct _writer *w, struct _split *s, struct _split_obj *r)
+{
+	struct _writer *c = &s->chunks[r->chunk].w;
+	size_t from = r->from;
+	if (r->err)
+		w->err = 1;
+	for (size_t j = r->seg; j < c->nsegs && c->segs[j].at < r->to; j++) {
+		emit_raw(w, c->buf + from, c->segs[j].at - from);
+		copy_in(w, c->segs[j].fd, c->segs[j].offset, c->segs[j].len);
+		from = c->segs[j].at;
+	}
+	emit_raw(w, c->buf + from, r->to - from);
+	w->pos += r->len;
+	w->last = '\n';
+}
+
+/* Write an xref section as a file without updates has it, a single
+subsection from 0 in which the ids missing from ids are free. ids are
+sorted, offs and gens go with them. */
+static void
+write_sparse_xref(struct _writer *w, unsigned int *ids, long *offs,
+		unsigned int *gens, size_t n)
+{
+	unsigned int size = n > 0 ? ids[n-1]+1 : 1;
+	puts_w(w, "xref\n0 ");
+	put_uint(w, size, 1);
+	putc_w(w, '\n');
+	size_t i = 0;
+	for (unsigned int id=0; id<size; id++) {
+		if (i < n && ids[i] == id) {
+			put_uint(w, offs[i], 10);
+			putc_w(w, ' ');
+			put_uint(w, gens[i], 5);
+			puts_w(w, " n \n");
+			i++;
+			continue;
+		}
+		/* free entries form a list starting at object 0 */
+		unsigned int next = id+1;
+		for (size_t j=i; j<n && ids[j] == next; j++)
+			next++;
+		put_uint(w, next < size ? next : 0, 10);
+		puts_w(w, id == 0 ? " 65535 f \n" : " 00001 f \n");
+	}
+}
+
+static void
+write_split_output(void *arg, size_t k)
+{
+	struct _split *s = arg;
+	struct _idlist *ids = &s->ids[k];
+	pag_document *doc = s->doc;
+	unsigned int catalog = s->len+1, root = s->len+2;
+
+	struct _writer w;
+	init_sink_writer(&w, s->sinks[k]);
+	w.compact = s->compact;
+	write_pdf_version(&w, doc->version);
+
+	size_t n = ids->len;
+	unsigned int *all = malloc((n+2) * sizeof(unsigned int));
+	unsigned int *gens = malloc((n+2) * sizeof(unsigned int));
+	long *offs = malloc((n+2) * sizeof(long));
+	for (size_t i=0; i<n; i++) {
+		unsigned int id = ids->ids[i];
+		all[i] = id;
+		gens[i] = doc->objs[id-1].gen;
+		offs[i] = w.pos;
+		emit_split_obj(&w, s, &s->recs[s->rec[id]]);
+	}
+
+	pag_array *kids = NULL, *last = NULL;
+	for (int i=0; i < s->npages[k]; i++) {
+		unsigned int id = s->tree->pages[s->pages[k][i]].id;
+		pag_array *node = pag_make_array_single(pag_ref2obj(
+			pag_make_ref(id, doc->objs[id-1].gen, NULL)));
+		if (last == NULL)
+			kids = node;
+		else
+			last->next = node;
+		last = node;
+	}
+	pag_dict *pages = pag_make_empty_dict();
+	pag_dict_set(pages, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("Pages")));
+	pag_dict_set(pages, pag_make_name("Kids"), pag_array2obj(kids));
+	pag_dict_set(pages, pag_make_name("Count"),
+		pag_int2obj(pag_make_int(s->npages[k])));
+	pag_dict *cat = pag_make_empty_dict();
+	pag_dict_set(cat, pag_make_name("Type"),
+		pag_name2obj(pag_make_name("Catalog")));
+	pag_dict_set(cat, pag_make_name("Pages"),
+		pag_ref2obj(pag_make_ref(root, 0, NULL)));
+
+	all[n] = catalog;
+	gens[n] = 0;
+	offs[n] = w.pos;
+	write_indirect_obj(&w, pag_make_ref(catalog, 0, pag_dict2obj(cat)));
+	all[n+1] = root;
+	gens[n+1] = 0;
+	offs[n+1] = w.pos;
+	write_indirect_obj(&w, pag_make_ref(root, 0, pag_dict2obj(pages)));
+
+	long startxref = w.pos;
+	write_sparse_xref(&w, all, offs, gens, n+2);
+	pag_dict *trailer = make_trailer(doc->trailer_dicts->val->val.dict,
+		root+1);
+	pag_dict_set(trailer, pag_make_name("Root"),
+		pag_ref2obj(pag_make_ref(catalog, 0, NULL)));
+	write_trailer(&w, startxref, pag_dict2obj(trailer));
+
+	s->err[k] = finish_sink_writer(&w, s->sinks[k]);
+	free(all);
+	free(gens);
+	free(offs);
+}
+
+int
+pag_split_document(pag_document *doc, int *pages[], int npages[], int n,
+		pag_sink *sinks[], pag_write_options *opts)
+{
+	pag_write_options defaults = pag_make_write_options();
+	if (opts == NULL)
+		opts = &defaults;
+	pag_pagetree *tree = pag_get_pagetree(doc);
+	if (tree == NULL)
+		return -1;
+	for (int k=0; k<n; k++)
+		for (int i=0; i<npages[k]; i++)
+			if (pages[k][i] < 0 || (size_t)pages[k][i] >= tree->len)
+				return -1;
+
+	struct _split s = {.doc=doc, .tree=tree, .len=doc->len, .compact=opts->compact,
+		.pages=pages, .npages=npages, .sinks=sinks};
+	s.pagecopy = calloc(s.len+1, sizeof(pag_object *));
+	for (int k=0; k<n; k++)
+		for (int i=0; i<npages[k]; i++) {
+			pag_page *page = pag_pagetree_get_page(tree, pages[k][i]);
+			if (s.pagecopy[page->id] == NULL)
+				s.pagecopy[page->id] = copy_page(page, s.len+2);
+		}
+
+	unsigned int *stamp = calloc(s.len+1, sizeof(unsigned int));
+	struct _idlist stack = {0}, children = {0};
+	s.ids = calloc(n > 0 ? n : 1, sizeof(struct _idlist));
+	for (int k=0; k<n; k++)
+		split_closure(&s, k, stamp, &stack, &children);
+	free(stack.ids);
+	free(children.ids);
+
+	/* the objects of all outputs, each serialized once */
+	char *used = calloc(s.len+1, 1);
+	for (int k=0; k<n; k++)
+		for (size_t i=0; i < s.ids[k].len; i++)
+			used[s.ids[k].ids[i]] = 1;
+	s.need = malloc((s.len+1) * sizeof(unsigned int));
+	s.rec = malloc((s.len+1) * sizeof(size_t));
+	int ret = 0;
+	for (unsigned int id=1; id <= s.len; id++) {
+		if (!used[id])
+			continue;
+		pag_object *obj = split_obj(&s, id);
+		if (obj->type == PAG_STREAM
+		    && pag_encode_stream(obj->val.stream) != 0)
+			ret = -1;
+		s.rec[id] = s.nneed;
+		s.need[s.nneed++] = id;
+	}
+	free(used);
+	free(stamp);
+
+	int threads = pag_nb_threads(opts->threads);
+	size_t nchunks = (s.nneed + OBJS_PER_CHUNK-1) / OBJS_PER_CHUNK;
+	s.recs = malloc((s.nneed > 0 ? s.nneed : 1) * sizeof(*s.recs));
+	s.chunks = calloc(nchunks > 0 ? nchunks : 1, sizeof(struct _chunk));
+	pag_parallel_for(threads, nchunks, serialize_split_chunk, &s);
+
+	s.err = calloc(n > 0 ? n : 1, sizeof(int));
+	pag_parallel_for(threads, n, write_split_output, &s);
+
+	for (int k=0; k<n; k++) {
+		if (s.err[k] != 0)
+			ret = -1;
+		free(s.ids[k].ids);
+	}
+	for (size_t k=0; k<nchunks; k++)
+		free_chunk(&s.chunks[k]);
+	for (unsigned int id=1; id <= s.len; id++)
+		pag_free_object(s.pagecopy[id]);
+	free(s.pagecopy);
+	free(s.need);
+	free(s.rec);
+	free(s.recs);
+	free(s.chunks);
+	free(s.ids);
+	free(s.err);
+	return ret;
+}